@@ -0,0 +1,347 @@
+/*
+ *                    BENCH.C
+ *
+ * "bench.c" is the benchmark of the Radix Sort: it sweeps input
+ * sizes and key distributions over the openCL (LSD and MSD) and
+ * native sort sessions and the qsort and std::sort baselines, and prints the
+ * throughput of each (percentiles of timed repetitions after a
+ * warm-up) as CSV or JSON, to compare between versions.
+ *
+ * Usage: bench [-min log2] [-max log2] [-reps n] [-warmup n]
+ *              [-dist name] [-sorter name] [-format csv|json]
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+//Baselines of stdsort.cpp
+void std_sort_u32(uint32_t *keys, int size);
+void std_sort_u64(uint64_t *keys, int size);
+
+
+//Key distributions
+#define DIST_UNIFORM32  0
+#define DIST_UNIFORM64  1
+#define DIST_FEW_UNIQUE 2
+#define DIST_SORTED     3
+#define DIST_REVERSE    4
+#define DIST_ZIPF       5
+#define DIST_NARROW     6
+#define DISTS           7
+
+static const char *dist_names[DISTS] = {
+    "uniform32", "uniform64", "few_unique", "sorted", "reverse", "zipf", "narrow"
+};
+
+//Sorters
+#define SORTER_OPENCL     0
+#define SORTER_OPENCL_MSD 1
+#define SORTER_NATIVE     2
+#define SORTER_QSORT      3
+#define SORTER_STD        4
+#define SORTERS           5
+
+static const char *sorter_names[SORTERS] = {
+    "opencl", "opencl_msd", "native", "qsort", "std_sort"
+};
+
+//Distinct values of few_unique, ranks of zipf and width of narrow
+#define FEW_UNIQUE_VALUES 16
+#define ZIPF_RANKS (1 << 16)
+#define NARROW_BITS 12
+
+
+//xorshift64* (the inputs are the same on every run)
+static uint64_t bench_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+
+//**********************************************
+// bench_fill
+//
+//   Fills keys with size keys of a distribution
+//   (64-bit ones for uniform64, 32-bit otherwise)
+//**********************************************
+static void bench_fill(void *keys, int size, int dist) {
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    uint32_t *keys32 = (uint32_t*)keys;
+    uint32_t values[FEW_UNIQUE_VALUES];
+    double *cdf = NULL;
+    int i;
+
+    switch(dist) {
+        case DIST_UNIFORM64:
+            for(i = 0; i < size; i++)
+                ((uint64_t*)keys)[i] = bench_random(&state);
+            return;
+        case DIST_UNIFORM32:
+            for(i = 0; i < size; i++)
+                keys32[i] = (uint32_t)(bench_random(&state) >> 32);
+            return;
+        case DIST_FEW_UNIQUE:
+            for(i = 0; i < FEW_UNIQUE_VALUES; i++)
+                values[i] = (uint32_t)(bench_random(&state) >> 32);
+            for(i = 0; i < size; i++)
+                keys32[i] = values[bench_random(&state) % FEW_UNIQUE_VALUES];
+            return;
+        case DIST_SORTED:
+            for(i = 0; i < size; i++)
+                keys32[i] = (uint32_t)((uint64_t)i * 0xffffffffULL / size);
+            return;
+        case DIST_REVERSE:
+            for(i = 0; i < size; i++)
+                keys32[i] = (uint32_t)((uint64_t)(size - 1 - i) * 0xffffffffULL / size);
+            return;
+        case DIST_ZIPF:
+            //Rank r (from 1) has weight 1/r, and spread over the key bits
+            cdf = (double*)malloc(ZIPF_RANKS * sizeof(double));
+            cdf[0] = 1;
+            for(i = 1; i < ZIPF_RANKS; i++)
+                cdf[i] = cdf[i - 1] + 1.0 / (i + 1);
+            for(i = 0; i < size; i++) {
+                double u = (bench_random(&state) >> 11) * (1.0 / 9007199254740992.0) * cdf[ZIPF_RANKS - 1];
+                int lo = 0, hi = ZIPF_RANKS - 1;
+                while(lo < hi) {
+                    int mid = (lo + hi) / 2;
+                    if(cdf[mid] < u)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                keys32[i] = (uint32_t)(lo + 1) * 2654435761u;
+            }
+            free(cdf);
+            return;
+        case DIST_NARROW:
+            for(i = 0; i < size; i++)
+                keys32[i] = 0x40000000u + (uint32_t)(bench_random(&state) >> (64 - NARROW_BITS));
+            return;
+    }
+}
+
+
+//Whether keys (of keySize bytes) are in order
+static int bench_sorted(const void *keys, int size, int keySize) {
+    int i;
+    for(i = 1; i < size; i++) {
+        if(keySize == 8 ? ((const uint64_t*)keys)[i] < ((const uint64_t*)keys)[i - 1]
+                        : ((const uint32_t*)keys)[i] < ((const uint32_t*)keys)[i - 1])
+            return 0;
+    }
+    return 1;
+}
+
+//Percentile p (nearest rank) of n sorted times
+static double bench_percentile(const double *times, int n, int p) {
+    return times[(n - 1) * p / 100];
+}
+
+
+int main(int argc, char **argv) {
+
+    int minLog = 10, maxLog = 24, reps = 5, warmup = 1;
+    int json = 0, onlyDist = -1, onlySorter = -1;
+    int i, d, k;
+
+    //-------------------
+    // Parse the options
+    //-------------------
+    for(i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        if(!val) {
+            printf("Missing value of %s\n", arg);
+            exit(1);
+        }
+        i++;
+        if(strcmp(arg, "-min") == 0)
+            minLog = atoi(val);
+        else if(strcmp(arg, "-max") == 0)
+            maxLog = atoi(val);
+        else if(strcmp(arg, "-reps") == 0)
+            reps = atoi(val);
+        else if(strcmp(arg, "-warmup") == 0)
+            warmup = atoi(val);
+        else if(strcmp(arg, "-format") == 0)
+            json = strcmp(val, "json") == 0;
+        else if(strcmp(arg, "-dist") == 0 || strcmp(arg, "-sorter") == 0) {
+            int n = arg[1] == 'd' ? DISTS : SORTERS;
+            const char **names = arg[1] == 'd' ? dist_names : sorter_names;
+            for(k = 0; k < n && strcmp(names[k], val) != 0; k++);
+            if(k == n) {
+                printf("Unknown %s: [%s]\n", arg + 1, val);
+                exit(1);
+            }
+            if(arg[1] == 'd')
+                onlyDist = k;
+            else
+                onlySorter = k;
+        }
+        else {
+            printf("Unknown option: [%s]\n", arg);
+            exit(1);
+        }
+    }
+    if(minLog < 0 || maxLog > 30 || minLog > maxLog || reps < 1 || warmup < 0) {
+        printf("Sizes go from 2^0 to 2^30, with a repetition at least\n");
+        exit(1);
+    }
+
+    //------------------------------------
+    // Sessions of both key sizes (their
+    // programs built before any timing)
+    //------------------------------------
+    cl_uint numPlatforms = 0;
+    int opencl = clGetPlatformIDs(0, NULL, &numPlatforms) == CL_SUCCESS && numPlatforms > 0;
+    rs_session *sessions[SORTERS][2] = {{NULL, NULL}};
+    for(k = 0; k < 2; k++) {
+        int keyType = k ? RS_UINT64 : RS_UINT32;
+        if(opencl && (onlySorter < 0 || onlySorter == SORTER_OPENCL))
+            sessions[SORTER_OPENCL][k] = rs_session_create(keyType, 0);
+        if(opencl && (onlySorter < 0 || onlySorter == SORTER_OPENCL_MSD))
+            sessions[SORTER_OPENCL_MSD][k] = rs_session_create(keyType, RS_MSD);
+        if(onlySorter < 0 || onlySorter == SORTER_NATIVE)
+            sessions[SORTER_NATIVE][k] = rs_session_create_native(keyType, 0);
+    }
+    if(!opencl && (onlySorter == SORTER_OPENCL || onlySorter == SORTER_OPENCL_MSD))
+        fprintf(stderr, "No openCL platform, nothing to run\n");
+
+    if(json)
+        printf("[");
+    else
+        printf("sorter,dist,key_bits,keys,reps,min_s,p10_s,p50_s,p90_s,max_s,keys_per_sec,gb_per_sec,sorted\n");
+    int records = 0;
+
+    //----------------------------
+    // Sweep sizes, distributions
+    // and sorters
+    //----------------------------
+    double *times = (double*)malloc(reps * sizeof(double));
+    int lg;
+    for(lg = minLog; lg <= maxLog; lg++) {
+        int size = 1 << lg;
+        for(d = 0; d < DISTS; d++) {
+            if(onlyDist >= 0 && d != onlyDist)
+                continue;
+            int keySize = d == DIST_UNIFORM64 ? 8 : 4;
+            void *input = malloc((size_t)keySize * size);
+            void *output = malloc((size_t)keySize * size);
+            if(!input || !output) {
+                fprintf(stderr, "Not enough memory for %d keys\n", size);
+                exit(1);
+            }
+            bench_fill(input, size, d);
+
+            int sorter;
+            for(sorter = 0; sorter < SORTERS; sorter++) {
+                if(onlySorter >= 0 && sorter != onlySorter)
+                    continue;
+                rs_session *s = sessions[sorter][keySize == 8];
+                if(sorter != SORTER_QSORT && sorter != SORTER_STD && (!s || size > rs_session_max_keys(s)))
+                    continue;
+
+                int rep;
+                for(rep = -warmup; rep < reps; rep++) {
+                    //Baselines sort in place, a fresh copy each time
+                    if(sorter == SORTER_QSORT || sorter == SORTER_STD)
+                        memcpy(output, input, (size_t)keySize * size);
+                    double start = bench_now();
+                    switch(sorter) {
+                        case SORTER_OPENCL:
+                        case SORTER_OPENCL_MSD:
+                        case SORTER_NATIVE:
+                            rs_session_sort_into(s, input, output, size);
+                            break;
+                        case SORTER_QSORT:
+                            qsort(output, size, keySize, keySize == 8 ? cmp_u64 : cmp_u32);
+                            break;
+                        case SORTER_STD:
+                            if(keySize == 8)
+                                std_sort_u64((uint64_t*)output, size);
+                            else
+                                std_sort_u32((uint32_t*)output, size);
+                            break;
+                    }
+                    double end = bench_now();
+                    if(rep >= 0)
+                        times[rep] = end - start;
+                }
+
+                qsort(times, reps, sizeof(double), cmp_double);
+                double median = bench_percentile(times, reps, 50);
+                double keysPerSec = median > 0 ? size / median : 0;
+                double gbPerSec = keysPerSec * keySize / 1e9;
+                int sorted = bench_sorted(output, size, keySize);
+                if(json)
+                    printf("%s\n{\"sorter\":\"%s\",\"dist\":\"%s\",\"key_bits\":%d,\"keys\":%d,\"reps\":%d,"
+                           "\"min_s\":%.9f,\"p10_s\":%.9f,\"p50_s\":%.9f,\"p90_s\":%.9f,\"max_s\":%.9f,"
+                           "\"keys_per_sec\":%.1f,\"gb_per_sec\":%.4f,\"sorted\":%s}",
+                           records ? "," : "", sorter_names[sorter], dist_names[d], keySize * 8, size, reps,
+                           times[0], bench_percentile(times, reps, 10), median, bench_percentile(times, reps, 90), times[reps - 1],
+                           keysPerSec, gbPerSec, sorted ? "true" : "false");
+                else
+                    printf("%s,%s,%d,%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.1f,%.4f,%d\n",
+                           sorter_names[sorter], dist_names[d], keySize * 8, size, reps,
+                           times[0], bench_percentile(times, reps, 10), median, bench_percentile(times, reps, 90), times[reps - 1],
+                           keysPerSec, gbPerSec, sorted);
+                fflush(stdout);
+                records++;
+            }
+            free(input);
+            free(output);
+        }
+    }
+    if(json)
+        printf("\n]\n");
+
+    //----------------
+    // Free resources
+    //----------------
+    free(times);
+    for(i = 0; i < SORTERS; i++)
+        for(k = 0; k < 2; k++)
+            if(sessions[i][k])
+                rs_session_destroy(sessions[i][k]);
+    return 0;
+}
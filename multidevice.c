@@ -0,0 +1,375 @@
+/*
+ *                  MULTIDEVICE.C
+ *
+ * "multidevice.c" sorts across every openCL device of every
+ * platform: the keys are split by sampled splitters into one
+ * range per device, sized by how fast each device sorts, and
+ * the ranges are sorted at the same time, each on its own
+ * session, queue and host thread.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+//**********************************************
+// Multi-device sort
+//
+//   A session per device, the speed (keys per
+//   second) its sorts were timed at, and an
+//   estimate from its compute units and clock.
+//   The estimates split the sorts until every
+//   device has been timed (the two are in
+//   different units, so they are never mixed)
+//**********************************************
+struct rs_multi {
+    int ndevices;
+    rs_session **sessions;
+    double *speed;
+    double *estimate;
+    int *timed;
+
+    //Sub-devices created for RS_SUBDEVICES (released on destroy)
+    cl_device_id *subdevices;
+    int nsubdevices;
+
+    int keyType;
+    int keySize;
+};
+
+//Range of keys a device thread sorts in place, and how long it took
+typedef struct {
+    rs_session *session;
+    char *keys;
+    int size;
+    double seconds;
+} rs_multi_part;
+
+//Key bits and position in the input: the ranges are split on both, so
+//the copies of one key spread over the ranges by position
+typedef struct {
+    uint64_t bits;
+    int index;
+} rs_multi_key;
+
+//Slice of the input a partition thread counts and moves to the ranges
+typedef struct {
+    const char *array;
+    char *output;
+    int begin, end;
+    int keyType, keySize;
+    int nsplitters;
+    const rs_multi_key *splitters;
+    int *counts;   //Keys of the slice per range, then where they go
+} rs_multi_slice;
+
+
+//Range of key i of the input: the splitters up to it
+static int rs_multi_range(const rs_multi_slice *sl, int i) {
+    uint64_t bits = rs_key_bits(sl->array + (size_t)i * sl->keySize, sl->keyType);
+    int d = 0;
+    while(d < sl->nsplitters && (sl->splitters[d].bits < bits || (sl->splitters[d].bits == bits && sl->splitters[d].index <= i)))
+        d++;
+    return d;
+}
+
+//Counts the keys of a slice per range
+static void *rs_multi_count(void *arg) {
+    rs_multi_slice *sl = (rs_multi_slice*)arg;
+    int i;
+    for(i = sl->begin; i < sl->end; i++)
+        sl->counts[rs_multi_range(sl, i)]++;
+    return NULL;
+}
+
+//Moves the keys of a slice to its place in their ranges (counts hold it)
+static void *rs_multi_scatter(void *arg) {
+    rs_multi_slice *sl = (rs_multi_slice*)arg;
+    int i;
+    for(i = sl->begin; i < sl->end; i++) {
+        const char *key = sl->array + (size_t)i * sl->keySize;
+        int d = rs_multi_range(sl, i);
+        memcpy(sl->output + (size_t)sl->counts[d]++ * sl->keySize, key, sl->keySize);
+    }
+    return NULL;
+}
+
+//Sorts the range of a device, timing it
+static void *rs_multi_sort_part(void *arg) {
+    rs_multi_part *part = (rs_multi_part*)arg;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rs_session_sort_inplace(part->session, part->keys, part->size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    part->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    return NULL;
+}
+
+//Weight of device d in the split of a sort: its timed speed once every
+//device has been timed, its estimate until then
+static double rs_multi_weight(const rs_multi *m, int d) {
+    int i;
+    for(i = 0; i < m->ndevices; i++)
+        if(!m->timed[i])
+            return m->estimate[d];
+    return m->speed[d];
+}
+
+static int cmpkeys(const void *a, const void *b) {
+    const rs_multi_key *x = (const rs_multi_key*)a, *y = (const rs_multi_key*)b;
+    if(x->bits != y->bits)
+        return (x->bits > y->bits) - (x->bits < y->bits);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+
+//**********************************************
+// rs_multi_create
+//
+//   Creates a session on every device of every
+//   platform (CPU devices split by NUMA node
+//   with RS_SUBDEVICES), for keyType keys
+//**********************************************
+rs_multi *rs_multi_create(int keyType, int flags) {
+
+    rs_multi *m = (rs_multi*)calloc(1, sizeof(rs_multi));
+    m->keyType = keyType;
+    m->keySize = KEY_SIZE(keyType);
+
+    cl_int errNum;
+    cl_uint numPlatforms = 0;
+    errNum = clGetPlatformIDs(0, NULL, &numPlatforms);
+    if(!errNum == CL_SUCCESS || numPlatforms == 0){
+        printf("No openCL platforms found\n");
+        exit(1);
+    }
+    cl_platform_id *platforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
+    errNum = clGetPlatformIDs(numPlatforms, platforms, NULL);
+
+    //-----------------------------
+    // Gather the devices to use
+    //-----------------------------
+    cl_device_id *devices = NULL;
+    int ndevices = 0;
+    cl_uint p, d;
+    for(p = 0; p < numPlatforms; p++) {
+        cl_uint numDevices = 0;
+        if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices) != CL_SUCCESS)
+            continue;
+        cl_device_id *platformDevices = (cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
+        clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, numDevices, platformDevices, NULL);
+
+        for(d = 0; d < numDevices; d++) {
+            cl_device_type type = 0;
+            clGetDeviceInfo(platformDevices[d], CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+
+            //A CPU device per NUMA node (kept whole if it can't be split)
+            cl_uint numSub = 0;
+            cl_device_partition_property numa[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                                                   CL_DEVICE_AFFINITY_DOMAIN_NEXT_PARTITIONABLE, 0};
+            if((flags & RS_SUBDEVICES) && (type & CL_DEVICE_TYPE_CPU) &&
+               clCreateSubDevices(platformDevices[d], numa, 0, NULL, &numSub) == CL_SUCCESS && numSub > 1) {
+                devices = (cl_device_id*)realloc(devices, (ndevices + numSub) * sizeof(cl_device_id));
+                m->subdevices = (cl_device_id*)realloc(m->subdevices, (m->nsubdevices + numSub) * sizeof(cl_device_id));
+                clCreateSubDevices(platformDevices[d], numa, numSub, devices + ndevices, NULL);
+                memcpy(m->subdevices + m->nsubdevices, devices + ndevices, numSub * sizeof(cl_device_id));
+                ndevices += numSub;
+                m->nsubdevices += numSub;
+            }
+            else {
+                devices = (cl_device_id*)realloc(devices, (ndevices + 1) * sizeof(cl_device_id));
+                devices[ndevices++] = platformDevices[d];
+            }
+        }
+        free(platformDevices);
+    }
+    free(platforms);
+    if(ndevices == 0) {
+        printf("No openCL devices found\n");
+        exit(1);
+    }
+
+    //-------------------------------
+    // A session per device, and its
+    // estimated speed
+    //-------------------------------
+    m->ndevices = ndevices;
+    m->sessions = (rs_session**)malloc(ndevices * sizeof(rs_session*));
+    m->speed = (double*)calloc(ndevices, sizeof(double));
+    m->estimate = (double*)malloc(ndevices * sizeof(double));
+    m->timed = (int*)calloc(ndevices, sizeof(int));
+    int i;
+    for(i = 0; i < ndevices; i++) {
+        m->sessions[i] = rs_session_create_on(devices[i], keyType, flags);
+        cl_uint units = 1, clock = 1;
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &units, NULL);
+        clGetDeviceInfo(devices[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(cl_uint), &clock, NULL);
+        m->estimate[i] = (double)(units ? units : 1) * (clock ? clock : 1);
+    }
+    free(devices);
+
+    return m;
+}
+
+
+//**********************************************
+// rs_multi_sort
+//
+//   Returns a sorted (malloc'd) copy of array:
+//   the keys are moved to one range per device
+//   (split at sampled keys, copies of a key by
+//   their position, in proportion to the speed
+//   of each device) and every range is sorted
+//   in place at the same time
+//**********************************************
+void *rs_multi_sort(rs_multi *m, const void *array, int size) {
+
+    int keySize = m->keySize;
+    char *output = (char*)malloc((size_t)keySize * size);
+    int ndevices = m->ndevices;
+    int d, i;
+
+    //Small sorts (or a single device): the fastest device alone
+    if(ndevices == 1 || size < MULTI_MIN_KEYS) {
+        int fastest = 0;
+        for(d = 1; d < ndevices; d++)
+            if(rs_multi_weight(m, d) > rs_multi_weight(m, fastest))
+                fastest = d;
+        rs_session_sort_into(m->sessions[fastest], array, output, size);
+        return output;
+    }
+
+    //----------------------------------------
+    // Splitters: sampled keys at the fraction
+    // of the keys each device should take
+    //----------------------------------------
+    int nsamples = MULTI_SAMPLES * ndevices;
+    rs_multi_key *samples = (rs_multi_key*)malloc(nsamples * sizeof(rs_multi_key));
+    uint32_t seed = 0x9e3779b9u;
+    for(i = 0; i < nsamples; i++) {
+        //xorshift
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        samples[i].index = seed % size;
+        samples[i].bits = rs_key_bits((const char*)array + (size_t)samples[i].index * keySize, m->keyType);
+    }
+    qsort(samples, nsamples, sizeof(rs_multi_key), cmpkeys);
+
+    double total = 0, share = 0;
+    for(d = 0; d < ndevices; d++)
+        total += rs_multi_weight(m, d);
+    rs_multi_key *splitters = (rs_multi_key*)malloc(ndevices * sizeof(rs_multi_key));
+    for(d = 0; d < ndevices - 1; d++) {
+        share += rs_multi_weight(m, d) / total;
+        int sample = (int)(share * nsamples);
+        splitters[d] = samples[sample < nsamples ? sample : nsamples - 1];
+    }
+    free(samples);
+
+    //--------------------------------------
+    // Move the keys to their ranges: each
+    // thread counts a slice, then moves it
+    //--------------------------------------
+    rs_multi_slice *slices = (rs_multi_slice*)malloc(ndevices * sizeof(rs_multi_slice));
+    pthread_t *threads = (pthread_t*)malloc(ndevices * sizeof(pthread_t));
+    for(i = 0; i < ndevices; i++) {
+        rs_multi_slice sl = {(const char*)array, output, (int)((size_t)size * i / ndevices), (int)((size_t)size * (i + 1) / ndevices),
+                             m->keyType, keySize, ndevices - 1, splitters, (int*)calloc(ndevices, sizeof(int))};
+        slices[i] = sl;
+        pthread_create(&threads[i], NULL, rs_multi_count, &slices[i]);
+    }
+    for(i = 0; i < ndevices; i++)
+        pthread_join(threads[i], NULL);
+
+    //Ranges are laid out in order, and the slices in order inside them
+    int *rangeStart = (int*)malloc((ndevices + 1) * sizeof(int));
+    int start = 0;
+    for(d = 0; d < ndevices; d++) {
+        rangeStart[d] = start;
+        for(i = 0; i < ndevices; i++) {
+            int count = slices[i].counts[d];
+            slices[i].counts[d] = start;
+            start += count;
+        }
+    }
+    rangeStart[ndevices] = start;
+
+    for(i = 0; i < ndevices; i++)
+        pthread_create(&threads[i], NULL, rs_multi_scatter, &slices[i]);
+    for(i = 0; i < ndevices; i++)
+        pthread_join(threads[i], NULL);
+
+    //--------------------------------
+    // Sort every range on its device
+    //--------------------------------
+    rs_multi_part *parts = (rs_multi_part*)malloc(ndevices * sizeof(rs_multi_part));
+    for(d = 0; d < ndevices; d++) {
+        rs_multi_part part = {m->sessions[d], output + (size_t)rangeStart[d] * keySize, rangeStart[d + 1] - rangeStart[d], 0};
+        parts[d] = part;
+        pthread_create(&threads[d], NULL, rs_multi_sort_part, &parts[d]);
+    }
+    for(d = 0; d < ndevices; d++)
+        pthread_join(threads[d], NULL);
+
+    //The timed speeds size the next sort (averaged with the last ones),
+    //every device that sorted keys is timed
+    for(d = 0; d < ndevices; d++) {
+        if(parts[d].size == 0 || parts[d].seconds <= 0)
+            continue;
+        double speed = parts[d].size / parts[d].seconds;
+        m->speed[d] = m->timed[d] ? (m->speed[d] + speed) / 2 : speed;
+        m->timed[d] = 1;
+    }
+
+    for(i = 0; i < ndevices; i++)
+        free(slices[i].counts);
+    free(slices);
+    free(threads);
+    free(parts);
+    free(rangeStart);
+    free(splitters);
+    return output;
+}
+
+
+//Number of devices (and sessions) a multi-device sort uses
+int rs_multi_devices(rs_multi *m) {
+    return m->ndevices;
+}
+
+
+//**********************************************
+// rs_multi_destroy
+//
+//   Frees the sessions and sub-devices
+//**********************************************
+void rs_multi_destroy(rs_multi *m) {
+    int i;
+    for(i = 0; i < m->ndevices; i++)
+        rs_session_destroy(m->sessions[i]);
+    for(i = 0; i < m->nsubdevices; i++)
+        clReleaseDevice(m->subdevices[i]);
+    free(m->subdevices);
+    free(m->sessions);
+    free(m->speed);
+    free(m->estimate);
+    free(m->timed);
+    free(m);
+}
@@ -0,0 +1,672 @@
+/*
+ *                  NATIVESORT.C
+ *
+ * "nativesort.c" is the native backend of the Radix Sort: the
+ * same LSD design as the kernels (every digit counted upfront,
+ * constant passes skipped, one reorder per pass) run on a pool
+ * of host threads kept by the session, for hosts without openCL
+ * or where the openCL CPU runtime is slower.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+typedef struct rs_native rs_native;
+
+//Keys of a sort thread, its digit counts (then where its keys of each
+//digit go), its write-combining buffers, and the digits of the next pass
+//of the keys it moves, counted for the thread that reads them next
+//([thread][bucket]) along with that thread for each digit
+typedef struct {
+    rs_native *sort;
+    int begin, end;
+    int *counts;
+    int *fill;
+    char *wcKeys;
+    char *wcValues;
+    int *next;
+    int *owner;
+} rs_native_thread;
+
+//A pool thread, the workspace it works for and the last phase it saw
+typedef struct {
+    rs_native_workspace *workspace;
+    int index;
+    long seen;
+    pthread_t thread;
+} rs_native_worker;
+
+//**********************************************
+// Native workspace
+//
+//   Buffers of a session's native sorts (they
+//   only grow) and its pool of threads, started
+//   as sorts need them and kept until released.
+//   A phase runs on the threads of the sort
+//   (the calling one is the first): generation
+//   moves when one starts, and pending counts
+//   the pool threads still running it
+//**********************************************
+struct rs_native_workspace {
+    char *buffer;
+    size_t size;
+
+    int cpus;
+    int nworkers;
+    rs_native_worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    long generation;
+    int pending;
+    int closing;
+
+    //Phase in progress and the threads of its sort
+    void *(*phase)(void*);
+    rs_native_thread *threads;
+    int nthreads;
+};
+
+//**********************************************
+// Native sort
+//
+//   Key layout, the threads and the buffers the
+//   pass in progress reads and writes
+//**********************************************
+struct rs_native {
+    int keyType;
+    int keySize;
+    int radix;
+    int buckets;
+    int passes;
+
+    //Bytes per value moved along (0: none), and whether the first pass
+    //run generates them (the key indices of an argsort)
+    int valueSize;
+    int indices;
+
+    int nthreads;
+    rs_native_thread *threads;
+
+    //Pass in progress, its flags (PASS_FIRST...) and buffers, and the next
+    //pass run (-1: none)
+    int pass;
+    int nextPass;
+    int flags;
+    const char *src;
+    char *dst;
+    const char *valueSrc;
+    char *valueDst;
+};
+
+
+//Order-preserving transform of the key bits (encode of the kernels)
+static inline uint64_t rs_native_encode(const rs_native *n, uint64_t key) {
+    uint64_t sign = (uint64_t)1 << (n->keySize * 8 - 1);
+    uint64_t all = n->keySize == 8 ? ~0ULL : 0xffffffffULL;
+    switch(n->keyType) {
+        case RS_INT32:
+        case RS_INT64:
+            return key ^ sign;
+        case RS_FLOAT:
+        case RS_DOUBLE:
+            return key ^ ((key & sign) ? all : sign);
+    }
+    return key;
+}
+
+//Inverse of rs_native_encode
+static inline uint64_t rs_native_decode(const rs_native *n, uint64_t key) {
+    uint64_t sign = (uint64_t)1 << (n->keySize * 8 - 1);
+    uint64_t all = n->keySize == 8 ? ~0ULL : 0xffffffffULL;
+    switch(n->keyType) {
+        case RS_INT32:
+        case RS_INT64:
+            return key ^ sign;
+        case RS_FLOAT:
+        case RS_DOUBLE:
+            return key ^ ((key & sign) ? sign : all);
+    }
+    return key;
+}
+
+//Word i of an array of 4 or 8 byte words
+static inline uint64_t rs_native_load(const char *array, int i, int size) {
+    return size == 8 ? ((const uint64_t*)array)[i] : ((const uint32_t*)array)[i];
+}
+
+static inline void rs_native_store(char *array, int i, int size, uint64_t word) {
+    if(size == 8)
+        ((uint64_t*)array)[i] = word;
+    else
+        ((uint32_t*)array)[i] = (uint32_t)word;
+}
+
+
+//Runs the phases of the sorts given to a pool thread, until released
+static void *rs_native_work(void *arg) {
+    rs_native_worker *w = (rs_native_worker*)arg;
+    rs_native_workspace *ws = w->workspace;
+
+    pthread_mutex_lock(&ws->lock);
+    for(;;) {
+        while(ws->generation == w->seen && !ws->closing)
+            pthread_cond_wait(&ws->start, &ws->lock);
+        if(ws->closing)
+            break;
+        w->seen = ws->generation;
+        if(w->index >= ws->nthreads)
+            continue;
+        pthread_mutex_unlock(&ws->lock);
+
+        ws->phase(&ws->threads[w->index]);
+
+        pthread_mutex_lock(&ws->lock);
+        if(--ws->pending == 0)
+            pthread_cond_signal(&ws->done);
+    }
+    pthread_mutex_unlock(&ws->lock);
+    return NULL;
+}
+
+//Runs a phase on every thread of the sort (the calling one takes the first)
+static void rs_native_run(rs_native_workspace *ws, rs_native *n, void *(*phase)(void*)) {
+    pthread_mutex_lock(&ws->lock);
+    ws->phase = phase;
+    ws->threads = n->threads;
+    ws->nthreads = n->nthreads;
+    ws->pending = n->nthreads - 1;
+    ws->generation++;
+    pthread_cond_broadcast(&ws->start);
+    pthread_mutex_unlock(&ws->lock);
+
+    phase(&n->threads[0]);
+
+    pthread_mutex_lock(&ws->lock);
+    while(ws->pending > 0)
+        pthread_cond_wait(&ws->done, &ws->lock);
+    pthread_mutex_unlock(&ws->lock);
+}
+
+//Grows the workspace (created on first use) to size bytes and its pool to
+//nthreads threads, the calling one included, and returns its buffer
+static char *rs_native_reserve(rs_native_workspace **workspace, size_t size, int nthreads) {
+    rs_native_workspace *ws = *workspace;
+    if(!ws) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        ws = (rs_native_workspace*)calloc(1, sizeof(rs_native_workspace));
+        if(ws) {
+            ws->cpus = cpus > 0 ? (int)cpus : 1;
+            ws->workers = (rs_native_worker*)calloc(ws->cpus, sizeof(rs_native_worker));
+        }
+        if(!ws || !ws->workers) {
+            printf("Error allocating a native workspace\n");
+            exit(1);
+        }
+        pthread_mutex_init(&ws->lock, NULL);
+        pthread_cond_init(&ws->start, NULL);
+        pthread_cond_init(&ws->done, NULL);
+        *workspace = ws;
+    }
+    if(size > ws->size) {
+        free(ws->buffer);
+        ws->buffer = (char*)malloc(size);
+        if(!ws->buffer) {
+            printf("Error allocating %zu bytes for a native sort\n", size);
+            exit(1);
+        }
+        ws->size = size;
+    }
+
+    //New threads take the phases from the next one on
+    pthread_mutex_lock(&ws->lock);
+    while(ws->nworkers + 1 < nthreads) {
+        rs_native_worker *w = &ws->workers[++ws->nworkers];
+        w->workspace = ws;
+        w->index = ws->nworkers;
+        w->seen = ws->generation;
+        if(pthread_create(&w->thread, NULL, rs_native_work, w)) {
+            printf("Error starting a native sort thread\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&ws->lock);
+    return ws->buffer;
+}
+
+//Stops the pool threads and frees the workspace (none: nothing to do)
+void rs_native_release(rs_native_workspace *workspace) {
+    int w;
+    if(!workspace)
+        return;
+    pthread_mutex_lock(&workspace->lock);
+    workspace->closing = 1;
+    pthread_cond_broadcast(&workspace->start);
+    pthread_mutex_unlock(&workspace->lock);
+    for(w = 1; w <= workspace->nworkers; w++)
+        pthread_join(workspace->workers[w].thread, NULL);
+    pthread_mutex_destroy(&workspace->lock);
+    pthread_cond_destroy(&workspace->start);
+    pthread_cond_destroy(&workspace->done);
+    free(workspace->workers);
+    free(workspace->buffer);
+    free(workspace);
+}
+
+//Offset of the next size bytes of a workspace (cache line aligned)
+static size_t rs_native_take(size_t *used, size_t size) {
+    size_t at = *used;
+    *used += (size + 63) / 64 * 64;
+    return at;
+}
+
+
+//Counts the digits of every pass of the thread keys in one read
+static void *rs_native_histogram(void *arg) {
+    rs_native_thread *t = (rs_native_thread*)arg;
+    rs_native *n = t->sort;
+    int i, pass;
+    uint64_t mask = n->buckets - 1;
+    memset(t->counts, 0, sizeof(int) * n->passes * n->buckets);
+    for(i = t->begin; i < t->end; i++) {
+        uint64_t key = rs_native_encode(n, rs_native_load(n->src, i, n->keySize));
+        for(pass = 0; pass < n->passes; pass++)
+            t->counts[pass * n->buckets + ((key >> (pass * n->radix)) & mask)]++;
+    }
+    return NULL;
+}
+
+//**********************************************
+// rs_native_scatter
+//
+//   Moves the thread keys (and values) to their
+//   place by the pass digit. Each digit fills a
+//   write-combining buffer of NATIVE_WC_BYTES
+//   that goes out whole, so the writes to the
+//   destination come in full lines. The digit
+//   of the next pass of each key is counted for
+//   the thread whose keys it lands among, so
+//   that pass needs no count of its own
+//**********************************************
+static void *rs_native_scatter(void *arg) {
+    rs_native_thread *t = (rs_native_thread*)arg;
+    rs_native *n = t->sort;
+    int keySize = n->keySize, valueSize = n->valueSize;
+    int line = NATIVE_WC_BYTES / keySize;
+    int shift = n->pass * n->radix;
+    int nextShift = n->nextPass * n->radix;
+    uint64_t mask = n->buckets - 1;
+    int *pos = t->counts;
+    int *fill = t->fill;
+    int i, d;
+
+    memset(fill, 0, sizeof(int) * n->buckets);
+    if(n->nextPass >= 0) {
+        memset(t->next, 0, sizeof(int) * n->nthreads * n->buckets);
+        memset(t->owner, 0, sizeof(int) * n->buckets);
+    }
+    for(i = t->begin; i < t->end; i++) {
+        uint64_t key = rs_native_load(n->src, i, keySize);
+        if(n->flags & PASS_FIRST)
+            key = rs_native_encode(n, key);
+        d = (int)((key >> shift) & mask);
+        int slot = d * line + fill[d];
+        if(n->nextPass >= 0) {
+            //The keys of a digit go to consecutive places, so its owner
+            //only moves forward
+            int at = pos[d] + fill[d], o = t->owner[d];
+            while(at >= n->threads[o].end)
+                o++;
+            t->owner[d] = o;
+            t->next[o * n->buckets + ((key >> nextShift) & mask)]++;
+        }
+        rs_native_store(t->wcKeys, slot, keySize, (n->flags & PASS_LAST) ? rs_native_decode(n, key) : key);
+        if(valueSize)
+            rs_native_store(t->wcValues, slot, valueSize, (n->indices && (n->flags & PASS_FIRST)) ? (uint64_t)i : rs_native_load(n->valueSrc, i, valueSize));
+
+        if(++fill[d] == line) {
+            memcpy(n->dst + (size_t)pos[d] * keySize, t->wcKeys + (size_t)d * line * keySize, line * keySize);
+            if(valueSize)
+                memcpy(n->valueDst + (size_t)pos[d] * valueSize, t->wcValues + (size_t)d * line * valueSize, line * valueSize);
+            pos[d] += line;
+            fill[d] = 0;
+        }
+    }
+
+    //What is left of each buffer
+    for(d = 0; d < n->buckets; d++) {
+        memcpy(n->dst + (size_t)pos[d] * keySize, t->wcKeys + (size_t)d * line * keySize, fill[d] * keySize);
+        if(valueSize)
+            memcpy(n->valueDst + (size_t)pos[d] * valueSize, t->wcValues + (size_t)d * line * valueSize, fill[d] * valueSize);
+    }
+    return NULL;
+}
+
+
+//**********************************************
+// rs_native_sort
+//
+//   Sorts the keys in array into output (if not
+//   NULL) carrying along the values, like the
+//   session sorts: 32/64-bit words (valueWords
+//   1/2), the key indices (INDEX_VALUES) or none
+//   (0), on as many threads as the input keeps
+//   busy (NATIVE_THREAD_KEYS each). Every buffer
+//   and thread comes from *workspace (created
+//   on first use, see rs_native_release)
+//**********************************************
+void rs_native_sort(int keyType, int radix, void *array, void *output, void *values, void *values_output, int valueWords, int size,
+                    rs_native_workspace **workspace) {
+
+    rs_native n;
+    memset(&n, 0, sizeof(n));
+    n.keyType = keyType;
+    n.keySize = KEY_SIZE(keyType);
+    n.radix = radix;
+    n.buckets = 1 << radix;
+    n.passes = (n.keySize * 8 + radix - 1) / radix;
+    n.valueSize = valueWords == INDEX_VALUES ? sizeof(cl_uint) : valueWords * sizeof(cl_uint);
+    n.indices = valueWords == INDEX_VALUES;
+
+    size_t array_dataSize = (size_t)n.keySize * size;
+    size_t value_dataSize = (size_t)n.valueSize * size;
+
+    //-----------------------------
+    // Threads and their keys
+    //-----------------------------
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n.nthreads = cpus > 0 ? (int)cpus : 1;
+    if(n.nthreads > size / NATIVE_THREAD_KEYS)
+        n.nthreads = size / NATIVE_THREAD_KEYS > 0 ? size / NATIVE_THREAD_KEYS : 1;
+
+    //-----------------------
+    // Carve the workspace
+    //-----------------------
+
+    //Threads, then per thread its counts and buffers, then the scratch
+    //copies the passes alternate with (and a target for argsorts)
+    size_t used = 0;
+    size_t threadsAt = rs_native_take(&used, n.nthreads * sizeof(rs_native_thread));
+    size_t threadAt = used;
+    size_t wcValueBytes = (size_t)n.buckets * NATIVE_WC_BYTES / n.keySize * n.valueSize;
+    rs_native_take(&used, sizeof(int) * n.passes * n.buckets);
+    rs_native_take(&used, sizeof(int) * n.buckets);
+    rs_native_take(&used, (size_t)n.buckets * NATIVE_WC_BYTES);
+    rs_native_take(&used, wcValueBytes);
+    rs_native_take(&used, sizeof(int) * n.nthreads * n.buckets);
+    rs_native_take(&used, sizeof(int) * n.buckets);
+    size_t threadBytes = used - threadAt;
+    used += threadBytes * (n.nthreads - 1);
+    size_t scratchAt = rs_native_take(&used, array_dataSize);
+    size_t targetAt = rs_native_take(&used, output ? 0 : array_dataSize);
+    size_t valueScratchAt = rs_native_take(&used, value_dataSize);
+    char *base = rs_native_reserve(workspace, used, n.nthreads);
+    rs_native_workspace *ws = *workspace;
+
+    n.threads = (rs_native_thread*)(base + threadsAt);
+    int t, d, pass;
+    for(t = 0; t < n.nthreads; t++) {
+        rs_native_thread *th = &n.threads[t];
+        size_t at = threadAt + threadBytes * t;
+        th->sort = &n;
+        th->begin = (int)((size_t)size * t / n.nthreads);
+        th->end = (int)((size_t)size * (t + 1) / n.nthreads);
+        th->counts = (int*)(base + rs_native_take(&at, sizeof(int) * n.passes * n.buckets));
+        th->fill = (int*)(base + rs_native_take(&at, sizeof(int) * n.buckets));
+        th->wcKeys = base + rs_native_take(&at, (size_t)n.buckets * NATIVE_WC_BYTES);
+        th->wcValues = base + rs_native_take(&at, wcValueBytes);
+        th->next = (int*)(base + rs_native_take(&at, sizeof(int) * n.nthreads * n.buckets));
+        th->owner = (int*)(base + rs_native_take(&at, sizeof(int) * n.buckets));
+    }
+
+    //-------------------------------------------
+    // Histogram every digit in one read of keys
+    //-------------------------------------------
+    n.src = (const char*)array;
+    rs_native_run(ws, &n, rs_native_histogram);
+
+    //Passes where every key falls in one bucket are skipped
+    int firstPass = -1, lastPass = -1, remaining = 0;
+    char skip[sizeof(cl_ulong) * 8];
+    for(pass = 0; pass < n.passes; pass++) {
+        skip[pass] = 0;
+        for(d = 0; d < n.buckets; d++) {
+            int count = 0;
+            for(t = 0; t < n.nthreads; t++)
+                count += n.threads[t].counts[pass * n.buckets + d];
+            if(count == size)
+                skip[pass] = 1;
+        }
+        if(!skip[pass]) {
+            if(firstPass < 0)
+                firstPass = pass;
+            lastPass = pass;
+            remaining++;
+        }
+    }
+
+    //-----------------------
+    // Buffers of the passes
+    //-----------------------
+
+    //In place, the passes alternate between the array and a scratch (and
+    //an odd number of them ends with a copy back). Otherwise the passes
+    //with an odd number remaining write the target (a temporary one if
+    //the caller doesn't want it) so the last one ends there
+    char *scratch = base + scratchAt;
+    char *target = (output && output != array) ? (char*)output : NULL;
+    if(!output)
+        target = base + targetAt;
+    char *valueScratch = base + valueScratchAt;
+    char *valueTarget = (n.valueSize && values_output != values) ? (char*)values_output : NULL;
+
+    const char *src = (const char*)array;
+    const char *valueSrc = (const char*)values;
+    for(pass = 0; pass < n.passes; pass++) {
+        if(skip[pass])
+            continue;
+
+        n.pass = pass;
+        for(n.nextPass = pass + 1; n.nextPass < n.passes && skip[n.nextPass]; n.nextPass++);
+        if(n.nextPass == n.passes)
+            n.nextPass = -1;
+        n.flags = (pass == firstPass ? PASS_FIRST : 0) | (pass == lastPass ? PASS_LAST : 0);
+        n.src = src;
+        n.valueSrc = valueSrc;
+        n.dst = target ? ((remaining % 2 == 1) ? target : scratch) : (src == scratch ? (char*)array : scratch);
+        n.valueDst = valueTarget ? ((remaining % 2 == 1) ? valueTarget : valueScratch) : (valueSrc == valueScratch ? (char*)values : valueScratch);
+        remaining--;
+
+        //The first pass run has its counts from the histogram, the others
+        //from the scatter before (what each thread moved to the keys of t)
+        if(pass == firstPass) {
+            for(t = 0; t < n.nthreads; t++)
+                memmove(n.threads[t].counts, n.threads[t].counts + pass * n.buckets, sizeof(int) * n.buckets);
+        }
+        else {
+            int from;
+            for(t = 0; t < n.nthreads; t++) {
+                int *counts = n.threads[t].counts;
+                memcpy(counts, n.threads[0].next + t * n.buckets, sizeof(int) * n.buckets);
+                for(from = 1; from < n.nthreads; from++)
+                    for(d = 0; d < n.buckets; d++)
+                        counts[d] += n.threads[from].next[t * n.buckets + d];
+            }
+        }
+
+        //Keys of a digit go after the smaller digits, and after the
+        //ones of the threads before
+        int start = 0;
+        for(d = 0; d < n.buckets; d++) {
+            for(t = 0; t < n.nthreads; t++) {
+                int count = n.threads[t].counts[d];
+                n.threads[t].counts[d] = start;
+                start += count;
+            }
+        }
+        rs_native_run(ws, &n, rs_native_scatter);
+
+        //The next pass reads what this one wrote
+        src = n.dst;
+        valueSrc = n.valueDst;
+    }
+
+    //-------------------------------------
+    // Leave the results where they belong
+    //-------------------------------------
+    if(firstPass < 0) {
+        //Nothing to reorder
+        if(output && output != array)
+            memcpy(output, array, array_dataSize);
+        if(n.indices) {
+            int i;
+            for(i = 0; i < size; i++)
+                ((cl_uint*)values_output)[i] = i;
+        }
+        else if(n.valueSize && valueTarget)
+            memcpy(values_output, values, value_dataSize);
+    }
+    else {
+        if(output == array && src != (const char*)array)
+            memcpy(array, src, array_dataSize);
+        if(n.valueSize && !valueTarget && valueSrc != (const char*)values)
+            memcpy(values, valueSrc, value_dataSize);
+    }
+}
+
+
+//Hash of the key bits (key_hash of the kernels)
+static uint32_t rs_native_hash(uint64_t key, int keySize, uint32_t seed) {
+    uint32_t h = (uint32_t)key ^ seed;
+    if(keySize == 8)
+        h = (h ^ (h >> 16)) * 0x85ebca6bu ^ (uint32_t)(key >> 32);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+
+//**********************************************
+// rs_native_check
+//
+//   Adds the checksum of keys (taken in the
+//   order of perm, if not NULL) to the input or
+//   output words of check, and for the output
+//   the keys smaller than the one before them
+//**********************************************
+void rs_native_check(int keyType, const void *keys, const int *perm, int size, cl_uint *check, int output) {
+    int keySize = KEY_SIZE(keyType);
+    uint64_t before = 0;
+    int i;
+    for(i = 0; i < size; i++) {
+        const char *key = (const char*)keys + (size_t)(perm ? perm[i] : i) * keySize;
+        uint64_t bits = rs_native_load(key, 0, keySize);
+        check[output ? CHECK_SUM_OUT : CHECK_SUM_IN] += rs_native_hash(bits, keySize, CHECK_SEED_SUM);
+        check[output ? CHECK_XOR_OUT : CHECK_XOR_IN] ^= rs_native_hash(bits, keySize, CHECK_SEED_XOR);
+        if(output) {
+            uint64_t item = rs_key_bits(key, keyType);
+            check[CHECK_INVERSIONS] += i > 0 && item < before;
+            before = item;
+        }
+    }
+}
+
+
+//**********************************************
+// rs_native_select
+//
+//   Order-preserving bits of the key of rank
+//   rank (from 0) of keys, digit by digit from
+//   the top like the session select. Once the
+//   keys still in the running are at most half
+//   of those read, they are moved to the
+//   workspace, and kept there from then on
+//**********************************************
+uint64_t rs_native_select(int keyType, int radix, const void *keys, int size, int rank, rs_native_workspace **workspace) {
+
+    rs_native n;
+    memset(&n, 0, sizeof(n));
+    n.keyType = keyType;
+    n.keySize = KEY_SIZE(keyType);
+    n.radix = radix;
+    n.buckets = 1 << radix;
+    n.passes = (n.keySize * 8 + radix - 1) / radix;
+
+    //Digit counts, then the keys kept (half of them at most)
+    size_t used = 0;
+    size_t countsAt = rs_native_take(&used, sizeof(int) * n.buckets);
+    size_t keptAt = rs_native_take(&used, (size_t)n.keySize * (size / 2));
+    char *base = rs_native_reserve(workspace, used, 1);
+    int *counts = (int*)(base + countsAt);
+    char *kept = base + keptAt;
+
+    uint64_t all = n.keySize == 8 ? ~0ULL : 0xffffffffULL;
+    uint64_t prefix = 0, mask = 0;
+    const char *src = (const char*)keys;
+    int nkeys = size, compact = 0, pass, i;
+    for(pass = n.passes - 1; pass >= 0; pass--) {
+        int shift = pass * radix, nkept = 0;
+        memset(counts, 0, sizeof(int) * n.buckets);
+        for(i = 0; i < nkeys; i++) {
+            uint64_t key = rs_native_load(src, i, n.keySize);
+            uint64_t item = rs_native_encode(&n, key);
+            if((item & mask) != prefix)
+                continue;
+            counts[(item >> shift) & (n.buckets - 1)]++;
+            //Moving them within kept is safe, they only go down
+            if(compact)
+                rs_native_store(kept, nkept++, n.keySize, key);
+        }
+        if(compact) {
+            src = kept;
+            nkeys = nkept;
+        }
+
+        //Digit holding the rank
+        int d = 0;
+        while(rank >= counts[d])
+            rank -= counts[d++];
+        prefix |= (uint64_t)d << shift;
+        mask |= ((uint64_t)(n.buckets - 1) << shift) & all;
+        compact = counts[d] <= nkeys / 2;
+    }
+    return prefix;
+}
+
+
+//Copies the keys below the order-preserving bits (above them, with above)
+//to output, returns how many
+int rs_native_gather(int keyType, const void *keys, int size, uint64_t bits, int above, void *output) {
+    rs_native n;
+    memset(&n, 0, sizeof(n));
+    n.keyType = keyType;
+    n.keySize = KEY_SIZE(keyType);
+    int count = 0, i;
+    for(i = 0; i < size; i++) {
+        uint64_t key = rs_native_load((const char*)keys, i, n.keySize);
+        uint64_t item = rs_native_encode(&n, key);
+        if(above ? item > bits : item < bits)
+            rs_native_store((char*)output, count++, n.keySize, key);
+    }
+    return count;
+}
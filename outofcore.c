@@ -0,0 +1,347 @@
+/*
+ *                  OUTOFCORE.C
+ *
+ * "outofcore.c" sorts files of keys larger than the device
+ * memory: device-sized chunks are sorted by sort sessions into
+ * runs, which are merged on the host. Both files are streamed
+ * through memory maps.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+//Chunks of the input sorted by one session (chunk first, first + step...)
+typedef struct {
+    rs_session *session;
+    const char *input;
+    char *runs;
+    size_t nkeys;
+    size_t chunkKeys;
+    int keySize;
+    int first, step;
+} ooc_pipeline;
+
+//Sorted runs and the part of them a merge thread takes
+typedef struct {
+    const char *runs;
+    size_t nkeys;
+    size_t chunkKeys;
+    int nruns;
+    int keyType, keySize;
+    char *output;
+    size_t *begin, *end;  //Per run
+    size_t rank;          //Output position of the first key
+} ooc_merge;
+
+
+//Keys of run r (the last one may be shorter)
+static size_t ooc_run_keys(const ooc_merge *m, int r) {
+    size_t begin = (size_t)r * m->chunkKeys;
+    return (m->nkeys - begin < m->chunkKeys) ? m->nkeys - begin : m->chunkKeys;
+}
+
+//Keys of run r below bits (or up to bits, if inclusive)
+static size_t ooc_bound(const ooc_merge *m, int r, uint64_t bits, int inclusive) {
+    const char *run = m->runs + (size_t)r * m->chunkKeys * m->keySize;
+    size_t lo = 0, hi = ooc_run_keys(m, r);
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t key = rs_key_bits(run + mid * m->keySize, m->keyType);
+        if(key < bits || (inclusive && key == bits))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+//**********************************************
+// ooc_split
+//
+//   Positions in each run of the merged key of
+//   the given rank: the key is searched on its
+//   bits, and its copies across the runs are
+//   taken in run order up to the rank
+//**********************************************
+static void ooc_split(const ooc_merge *m, size_t rank, size_t *pos) {
+    int r;
+    if(rank >= m->nkeys) {
+        for(r = 0; r < m->nruns; r++)
+            pos[r] = ooc_run_keys(m, r);
+        return;
+    }
+
+    //Smallest bits with more than rank keys up to them
+    uint64_t lo = 0, hi = ~0ULL;
+    while(lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        size_t count = 0;
+        for(r = 0; r < m->nruns; r++)
+            count += ooc_bound(m, r, mid, 1);
+        if(count > rank)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    size_t taken = 0;
+    for(r = 0; r < m->nruns; r++) {
+        pos[r] = ooc_bound(m, r, lo, 0);
+        taken += pos[r];
+    }
+    for(r = 0; r < m->nruns && taken < rank; r++) {
+        size_t equal = ooc_bound(m, r, lo, 1) - pos[r];
+        size_t more = (rank - taken < equal) ? rank - taken : equal;
+        pos[r] += more;
+        taken += more;
+    }
+}
+
+
+//Sorts the chunks of a pipeline into runs (the same offsets as the input)
+static void *ooc_sort_chunks(void *arg) {
+    ooc_pipeline *p = (ooc_pipeline*)arg;
+    size_t chunk;
+    for(chunk = p->first; chunk * p->chunkKeys < p->nkeys; chunk += p->step) {
+        size_t begin = chunk * p->chunkKeys;
+        size_t keys = (p->nkeys - begin < p->chunkKeys) ? p->nkeys - begin : p->chunkKeys;
+        rs_session_sort_into(p->session, (void*)(p->input + begin * p->keySize), p->runs + begin * p->keySize, (int)keys);
+    }
+    return NULL;
+}
+
+
+//**********************************************
+// ooc_merge_part
+//
+//   k-way merge of the part of the runs between
+//   begin and end, through a binary heap of the
+//   runs ordered by their next key
+//**********************************************
+static void *ooc_merge_part(void *arg) {
+    ooc_merge *m = (ooc_merge*)arg;
+    int keySize = m->keySize;
+    char *out = m->output + m->rank * keySize;
+
+    int *heap = (int*)malloc(m->nruns * sizeof(int));
+    uint64_t *next = (uint64_t*)malloc(m->nruns * sizeof(uint64_t));
+    size_t *pos = (size_t*)malloc(m->nruns * sizeof(size_t));
+    int r, n = 0;
+
+    for(r = 0; r < m->nruns; r++) {
+        pos[r] = m->begin[r];
+        if(pos[r] == m->end[r])
+            continue;
+        next[r] = rs_key_bits(m->runs + ((size_t)r * m->chunkKeys + pos[r]) * keySize, m->keyType);
+        //Sift up
+        int i = n++;
+        while(i > 0 && next[heap[(i - 1) / 2]] > next[r]) {
+            heap[i] = heap[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        heap[i] = r;
+    }
+
+    while(n > 0) {
+        r = heap[0];
+        const char *run = m->runs + (size_t)r * m->chunkKeys * keySize;
+        memcpy(out, run + pos[r] * keySize, keySize);
+        out += keySize;
+
+        //Replace the top with the next key of its run (or the last run)
+        if(++pos[r] < m->end[r])
+            next[r] = rs_key_bits(run + pos[r] * keySize, m->keyType);
+        else
+            r = heap[--n];
+        //Sift down
+        int i = 0;
+        while(2 * i + 1 < n) {
+            int child = 2 * i + 1;
+            if(child + 1 < n && next[heap[child + 1]] < next[heap[child]])
+                child++;
+            if(next[heap[child]] >= next[r])
+                break;
+            heap[i] = heap[child];
+            i = child;
+        }
+        if(n > 0)
+            heap[i] = r;
+    }
+
+    free(heap);
+    free(next);
+    free(pos);
+    return NULL;
+}
+
+
+//Maps size bytes of the open file fd (writable if asked)
+static char *ooc_map(int fd, size_t size, int writable) {
+    char *data = (char*)mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED) {
+        printf("Error mapping a file of %zu bytes\n", size);
+        exit(1);
+    }
+    //Sorts and merges stream through it
+    madvise(data, size, MADV_SEQUENTIAL);
+    return data;
+}
+
+
+//**********************************************
+// rs_sort_file
+//
+//   Sorts the keys of the file input into the
+//   file output: chunks that fit in the device
+//   are sorted into runs, OOC_PIPELINES chunks
+//   at a time on their own sessions and queues,
+//   then the runs are merged by host threads
+//   that take equal parts of the output
+//**********************************************
+void rs_sort_file(const char *input, const char *output, int keyType, int flags, size_t chunkKeys) {
+
+    int keySize = KEY_SIZE(keyType);
+
+    //-------------
+    // Open files
+    //-------------
+    int inFd = open(input, O_RDONLY);
+    struct stat st;
+    if(inFd < 0 || fstat(inFd, &st) != 0) {
+        printf("Error opening the input file: [%s]\n", input);
+        exit(1);
+    }
+    size_t bytes = st.st_size;
+    size_t nkeys = bytes / keySize;
+    if(bytes % keySize) {
+        printf("The input file doesn't hold whole keys: [%s]\n", input);
+        exit(1);
+    }
+
+    int outFd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(outFd < 0 || ftruncate(outFd, bytes) != 0) {
+        printf("Error creating the output file: [%s]\n", output);
+        exit(1);
+    }
+    if(nkeys == 0) {
+        close(inFd);
+        close(outFd);
+        return;
+    }
+    const char *in = ooc_map(inFd, bytes, 0);
+    char *out = ooc_map(outFd, bytes, 1);
+
+    //------------------------------
+    // Sessions and size of chunks
+    //------------------------------
+    rs_session *sessions[OOC_PIPELINES];
+    int p;
+    for(p = 0; p < OOC_PIPELINES; p++)
+        sessions[p] = p ? rs_session_create_shared(sessions[0]) : rs_session_create(keyType, flags);
+
+    //The pipelines share the device (one context and program): each gets
+    //its part of what a single sort could take
+    if(chunkKeys == 0)
+        chunkKeys = rs_session_max_keys(sessions[0]) / OOC_PIPELINES;
+    if(chunkKeys > LOOKBACK_MAX_KEYS)
+        chunkKeys = LOOKBACK_MAX_KEYS;
+
+    //It all fits: a single sort
+    if(nkeys <= chunkKeys) {
+        rs_session_sort_into(sessions[0], (void*)in, out, (int)nkeys);
+        for(p = 0; p < OOC_PIPELINES; p++)
+            rs_session_destroy(sessions[p]);
+        munmap((void*)in, bytes);
+        munmap(out, bytes);
+        close(inFd);
+        close(outFd);
+        return;
+    }
+
+    //The runs go to a temporary file next to the output (removed once closed)
+    char runsName[1024];
+    snprintf(runsName, sizeof(runsName), "%s.XXXXXX", output);
+    int runsFd = mkstemp(runsName);
+    if(runsFd < 0 || ftruncate(runsFd, bytes) != 0) {
+        printf("Error creating the runs file: [%s]\n", runsName);
+        exit(1);
+    }
+    unlink(runsName);
+    char *runs = ooc_map(runsFd, bytes, 1);
+
+    //----------------------
+    // Sort chunks into runs
+    //----------------------
+    ooc_pipeline pipelines[OOC_PIPELINES];
+    pthread_t threads[OOC_PIPELINES];
+    for(p = 0; p < OOC_PIPELINES; p++) {
+        ooc_pipeline pipeline = {sessions[p], in, runs, nkeys, chunkKeys, keySize, p, OOC_PIPELINES};
+        pipelines[p] = pipeline;
+        pthread_create(&threads[p], NULL, ooc_sort_chunks, &pipelines[p]);
+    }
+    for(p = 0; p < OOC_PIPELINES; p++) {
+        pthread_join(threads[p], NULL);
+        rs_session_destroy(sessions[p]);
+    }
+
+    //-------------------------------
+    // Merge runs into the output
+    //-------------------------------
+    int nruns = (nkeys + chunkKeys - 1) / chunkKeys;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus > 0 ? (int)cpus : 1;
+    if((size_t)nthreads > nkeys / OOC_MERGE_KEYS)
+        nthreads = nkeys / OOC_MERGE_KEYS > 0 ? nkeys / OOC_MERGE_KEYS : 1;
+
+    //Thread t merges from the split of rank t*nkeys/nthreads to the next
+    size_t *splits = (size_t*)malloc((size_t)(nthreads + 1) * nruns * sizeof(size_t));
+    ooc_merge *merges = (ooc_merge*)malloc(nthreads * sizeof(ooc_merge));
+    pthread_t *mergeThreads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    int t;
+    for(t = 0; t <= nthreads; t++) {
+        ooc_merge m = {runs, nkeys, chunkKeys, nruns, keyType, keySize, out, NULL, NULL, 0};
+        ooc_split(&m, nkeys / nthreads * t + (t == nthreads ? nkeys % nthreads : 0), splits + (size_t)t * nruns);
+    }
+    for(t = 0; t < nthreads; t++) {
+        ooc_merge m = {runs, nkeys, chunkKeys, nruns, keyType, keySize, out,
+                       splits + (size_t)t * nruns, splits + (size_t)(t + 1) * nruns, nkeys / nthreads * t};
+        merges[t] = m;
+        pthread_create(&mergeThreads[t], NULL, ooc_merge_part, &merges[t]);
+    }
+    for(t = 0; t < nthreads; t++)
+        pthread_join(mergeThreads[t], NULL);
+
+    //----------------
+    // Free resources
+    //----------------
+    free(splits);
+    free(merges);
+    free(mergeThreads);
+    munmap(runs, bytes);
+    munmap((void*)in, bytes);
+    munmap(out, bytes);
+    close(runsFd);
+    close(inFd);
+    close(outFd);
+}
@@ -0,0 +1,255 @@
+/*
+ *                  PROGRAMCACHE.C
+ *
+ * "programcache.c" builds the openCL programs of the Radix Sort
+ * implementation, keeping the compiled binaries in an on-disk
+ * cache so later runs can skip the compilation, and picks the
+ * vector width the programs are built with.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+//Function to determine a file size (from the current cursor pos.)
+static int filesize(FILE *fp) {
+    int prev=ftell(fp);
+    fseek(fp, 0L, SEEK_END);
+    int size = ftell(fp);
+    fseek(fp, prev, SEEK_SET); //return cursor to prev. pos.
+    return size;
+}
+
+//Reads a whole file, returns NULL if it can't be read
+static char *readfile(const char *file_name, size_t *size) {
+    FILE *fp = fopen(file_name, "rb");
+    if(!fp)
+        return NULL;
+    *size = filesize(fp);
+    char *str = (char*)malloc(*size + 1);
+    if(*size != fread(str, 1, *size, fp)) {
+        free(str);
+        fclose(fp);
+        return NULL;
+    }
+    str[*size] = '\0';
+    fclose(fp);
+    return str;
+}
+
+//FNV-1a hash, chained through h
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char*)data;
+    size_t i;
+    for(i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+//Hashes a device property string
+static uint64_t hashdeviceinfo(uint64_t h, cl_device_id device, cl_device_info param) {
+    char info[256] = "";
+    clGetDeviceInfo(device, param, sizeof(info), info, NULL);
+    return fnv1a(h, info, strlen(info) + 1);
+}
+
+
+//**********************************************
+// programkey
+//
+//   Cache key of a program: the device, the
+//   driver, the build options, the source and
+//   the local headers it includes (next to the
+//   source file, file_name)
+//**********************************************
+static uint64_t programkey(cl_device_id device, const char *file_name, const char *source, size_t sourceSize, const char *options) {
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = hashdeviceinfo(h, device, CL_DEVICE_NAME);
+    h = hashdeviceinfo(h, device, CL_DEVICE_VENDOR);
+    h = hashdeviceinfo(h, device, CL_DEVICE_VERSION);
+    h = hashdeviceinfo(h, device, CL_DRIVER_VERSION);
+    h = fnv1a(h, options, strlen(options) + 1);
+    h = fnv1a(h, source, sourceSize);
+
+    //Local includes (#include "file") are part of the program too
+    const char *inc = source;
+    while((inc = strstr(inc, "#include \"")) != NULL) {
+        inc += strlen("#include \"");
+        const char *end = strchr(inc, '"');
+        if(!end)
+            break;
+        const char *base = strrchr(file_name, '/');
+        char header[1280];
+        snprintf(header, sizeof(header), "%.*s%.*s", base ? (int)(base + 1 - file_name) : 0, file_name, (int)(end - inc), inc);
+        size_t headerSize;
+        char *headerStr = readfile(header, &headerSize);
+        if(headerStr) {
+            h = fnv1a(h, headerStr, headerSize);
+            free(headerStr);
+        }
+    }
+
+    return h;
+}
+
+
+//Prints the build log of a program and exits
+static void buildfailure(cl_program program, cl_device_id device, cl_int errNum) {
+    printf("Error building program. Using \"clBuildProgram\"\n");
+    if(errNum == CL_BUILD_PROGRAM_FAILURE){
+        printf("Failure to build the program executable\n");
+        size_t log_size;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        char *log = (char *) malloc(log_size);
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+        printf("*** BUILD INFO LOG *** \n%s\n", log);
+        free(log);
+    }
+    exit(1);
+}
+
+
+//**********************************************
+// rs_build_program
+//
+//   Returns the program in file_name built for
+//   device, loading it from the binary cache
+//   when possible and storing it otherwise
+//**********************************************
+cl_program rs_build_program(cl_context context, cl_device_id device, const char *file_name, const char *options) {
+
+    cl_int errNum;
+    cl_program program = NULL;
+
+    //----------------
+    // Import kernels
+    //----------------
+    size_t file_sourceSize;
+    char *file_sourceStr = readfile(file_name, &file_sourceSize);
+    if(!file_sourceStr) {
+        printf("Error reading the kernels file: [%s]\n", file_name);
+        exit(1);
+    }
+
+    //--------------------
+    // Locate cache entry
+    //--------------------
+    const char *cache_dir = getenv("RS_CACHE_DIR");
+    if(!cache_dir)
+        cache_dir = CACHE_DIR;
+
+    char cache_name[1024] = "";
+    if(cache_dir[0] != '\0') {
+        uint64_t key = programkey(device, file_name, file_sourceStr, file_sourceSize, options);
+        const char *base = strrchr(file_name, '/');
+        base = base ? base + 1 : file_name;
+        snprintf(cache_name, sizeof(cache_name), "%s/%s-%016" PRIx64 ".bin", cache_dir, base, key);
+    }
+
+    //---------------------------
+    // Try the cached binary
+    //---------------------------
+    size_t binarySize;
+    unsigned char *binary = cache_name[0] ? (unsigned char*)readfile(cache_name, &binarySize) : NULL;
+    if(binary) {
+        cl_int binaryStatus;
+        program = clCreateProgramWithBinary(context, 1, &device, &binarySize, (const unsigned char**)&binary, &binaryStatus, &errNum);
+        if(errNum == CL_SUCCESS && binaryStatus == CL_SUCCESS)
+            errNum = clBuildProgram(program, 1, &device, options, NULL, NULL);
+        if(errNum != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+            //Stale or corrupt entry, rebuild from source
+            if(program)
+                clReleaseProgram(program);
+            program = NULL;
+        }
+        free(binary);
+    }
+
+    if(program) {
+        free(file_sourceStr);
+        return program;
+    }
+
+    //----------------------------
+    // Create and compile program
+    //----------------------------
+
+    //Create program from file
+    program = clCreateProgramWithSource(context, 1, (const char**)&file_sourceStr, (const size_t*)&file_sourceSize, &errNum);
+    if(!errNum == CL_SUCCESS){
+        printf("Error obtaining program from source. Using \"clCreateProgramWithSource\"\n");
+        exit(1);
+    }
+    free(file_sourceStr);
+
+    errNum = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if(!errNum == CL_SUCCESS)
+        buildfailure(program, device, errNum);
+
+    //---------------------
+    // Store in the cache
+    //---------------------
+    if(cache_name[0] == '\0')
+        return program;
+
+    errNum = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL);
+    if(errNum != CL_SUCCESS || binarySize == 0)
+        return program;
+    binary = (unsigned char*)malloc(binarySize);
+    errNum = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, NULL);
+
+    if(errNum == CL_SUCCESS && (mkdir(cache_dir, 0755) == 0 || errno == EEXIST)) {
+        //Write to a unique temporary name and rename, so readers never see
+        //half a file and concurrent builds (in this process or others)
+        //never write the same one. mkstemp makes it private, the cache isn't
+        char tmp_name[1100];
+        snprintf(tmp_name, sizeof(tmp_name), "%s.XXXXXX", cache_name);
+        int fd = mkstemp(tmp_name);
+        if(fd >= 0) {
+            fchmod(fd, 0644);
+            FILE *fp = fdopen(fd, "wb");
+            size_t written = fp ? fwrite(binary, 1, binarySize, fp) : 0;
+            int closed = fp ? fclose(fp) : close(fd);
+            if(written != binarySize || closed != 0 || rename(tmp_name, cache_name) != 0)
+                remove(tmp_name);
+        }
+    }
+    free(binary);
+
+    return program;
+}
+
+
+//**********************************************
+// rs_vector_keys
+//
+//   Keys per vector load for the kernels built
+//   for device: 8 when it prefers vectors that
+//   wide for keys of keySize bytes, 4 otherwise
+//**********************************************
+int rs_vector_keys(cl_device_id device, int keySize) {
+    cl_uint width = 0;
+    clGetDeviceInfo(device, keySize == 8 ? CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG : CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT, sizeof(cl_uint), &width, NULL);
+    return width >= 8 ? 8 : 4;
+}
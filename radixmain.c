@@ -0,0 +1,117 @@
+/*
+ *                   RADIXMAIN.C
+ *
+ * "radixmain.c" is the test program of the openCL implementation
+ * of the Radix Sort algorithm: it sorts ARRLEN random keys and
+ * checks the result.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <time.h>
+#include <inttypes.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+int cmpfunc (const void * a, const void * b)
+{
+    return ( *(int*)a - *(int*)b );
+}
+
+int isPowerOfTwo(int x)
+{
+    return ((x != 0) && ((x & (x - 1)) == 0)) ? 1 : 0;
+}
+
+
+int main(void)
+{
+
+    int i, *array = malloc(sizeof(int) * ARRLEN);
+    #ifdef DEBUG
+    int constarr[8] = {120,223,102,300,335,160,253,111};
+    for(i=0; i<ARRLEN; i++)
+        array[i] = constarr[i];
+    #else
+    /*Define an array filling function for testing (random)*/
+    for(i=0; i<ARRLEN; i++){
+    array[i] = rand() % ARRLEN;
+    }   
+    #endif
+
+    int *sorted;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#ifdef PROFILE
+    //Call radixsort with per-stage profiling (JSON report on stderr)
+    rs_session *session = rs_session_create(RS_INT32, RS_VERIFY | RS_PROFILE);
+    sorted = rs_session_sort(session, array, ARRLEN);
+    rs_session_report(session, stderr);
+#else
+    //Call radixsort, checking the order on the device
+    rs_session *session = rs_session_create(RS_INT32, RS_VERIFY);
+    sorted = rs_session_sort(session, array, ARRLEN);
+#endif
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    uint64_t delta = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("Radixsort of %d numbers took %" PRIu64 " microseconds\n", ARRLEN, delta);
+
+/*
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    //Call quicksort
+    qsort(array, ARRLEN, sizeof(int), cmpfunc);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    delta = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("Quicksort of %d numbers took %" PRIu64 " microseconds\n", ARRLEN, delta);
+*/
+
+    //Check if sorted (the sort checked it before reading it back)
+    int sameKeys;
+    int outOfPlace = rs_session_verify(session, &sameKeys);
+    rs_session_destroy(session);
+    if(outOfPlace)
+        printf("Arreglo desordenado. Cantidad de elementos fuera de lugar: %d\n", outOfPlace);
+    else
+        printf("Arreglo ordenado.");
+    if(!sameKeys)
+        printf("\nLos elementos ordenados no son los originales.");
+    printf("\n\n");
+
+/*
+    //Check against qsort
+    for(i=0; i<ARRLEN; i++){
+        if(array[i] != sorted[i]){
+            printf("Differs!\n");
+            exit(1);
+        }
+    }
+*/
+ 
+#ifdef PRINT
+#endif
+    //Deactivate qsort before printing
+    printf("Arreglo Original:\n");
+    for(i=0; i<ARRLEN; i++) {
+        printf("[%d]", array[i]);
+    }
+    printf("\n\n");  
+    printf("Arreglo Ordenado:\n");
+    for(i=0; i<ARRLEN; i++) {
+        printf("[%d]", sorted[i]);
+    }
+    printf("\nCantidad de elementos en sorted: %d\n", i);
+    printf("\n\n");
+  
+    return 0;
+}
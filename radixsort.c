@@ -16,6 +16,7 @@
 #include <string.h>
 
 #include <time.h>
+#include <unistd.h>
 #include <inttypes.h>
 
 //OpenCL includes
@@ -23,170 +24,345 @@
 
 //Kernel includes
 #include "radixsort.h"
-#include "checkorder.c"
-
-int *radixsort(int *array, int size);
-int cmpfunc (const void * a, const void * b)
-{
-    return ( *(int*)a - *(int*)b );
-}
-
-int isPowerOfTwo(int x)
-{
-    return ((x != 0) && ((x & (x - 1)) == 0)) ? 1 : 0;
-}
 
 
-int main(void)
-{
+//Profiling record of one enqueued command (times in ns)
+typedef struct {
+    int stage;
+    int pass;   //-1 for transfers
+    cl_event event;
+    cl_ulong queued, submit, start, end;
+} rs_prof;
 
-    int i, *array = malloc(sizeof(int) * ARRLEN);
-    #ifdef DEBUG
-    int constarr[8] = {120,223,102,300,335,160,253,111};
-    for(i=0; i<ARRLEN; i++)
-        array[i] = constarr[i];
-    #else
-    /*Define an array filling function for testing (random)*/
-    for(i=0; i<ARRLEN; i++){
-    array[i] = rand() % ARRLEN;
-    }   
-    #endif
 
-    int *sorted;
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-    //Call radixsort
-    sorted = radixsort(array, ARRLEN);
-    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-    uint64_t delta = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-    printf("Radixsort of %d numbers took %" PRIu64 " microseconds\n", ARRLEN, delta);
-
-/*
-    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-    //Call quicksort
-    qsort(array, ARRLEN, sizeof(int), cmpfunc);
-    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-    delta = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
-    printf("Quicksort of %d numbers took %" PRIu64 " microseconds\n", ARRLEN, delta);
-*/
+//**********************************************
+// Sort session
+//
+//   Keeps the openCL context, command queue,
+//   built program, kernels and device buffers
+//   alive between sorts.
+//**********************************************
+struct rs_session {
+    //Device the session sorts on (none on the native backend), and the
+    //buffers and threads of native sorts (they only grow)
+    cl_device_id device;
+    int native;
+    rs_native_workspace *nativeWorkspace;
+
+    cl_context context;
+    cl_command_queue commandQueue;
+    cl_program program;
 
-    //Check if sorted with parallel check!
-    checkorder(sorted,ARRLEN);
+    //One reorder kernel per pass (their digit shifts are constants)
+    cl_kernel histogram, *reorder, verify, segments, count, select, gather;
 
-/*
-    //Check against qsort
-    for(i=0; i<ARRLEN; i++){
-        if(array[i] != sorted[i]){
-            printf("Differs!\n");
-            exit(1);
-        }
-    }
-*/
- 
-#ifdef PRINT
-#endif
-    //Deactivate qsort before printing
-    printf("Arreglo Original:\n");
-    for(i=0; i<ARRLEN; i++) {
-        printf("[%d]", array[i]);
-    }
-    printf("\n\n");  
-    printf("Arreglo Ordenado:\n");
-    for(i=0; i<ARRLEN; i++) {
-        printf("[%d]", sorted[i]);
+    cl_mem array_buffer;
+    cl_mem output_buffer;
+    cl_mem digits_buffer;
+
+    //Size in bytes of array_buffer and output_buffer (they only grow,
+    //zero-copy sorts use them as scratch)
+    size_t capacity;
+
+    //Payload buffers of key-value sorts (created on first use, they only grow)
+    cl_mem value_buffer;
+    cl_mem value_output_buffer;
+    size_t valueCapacity;
+
+    //Most work-groups a sort can use on this device
+    int maxGroups;
+
+    //Most keys of a segment sorted by one group in local memory, and the
+    //segment bounds and list of a launch (they only grow)
+    int segmentKeys;
+    cl_mem segment_offsets_buffer;
+    cl_mem segment_list_buffer;
+    int *segmentBounds;
+    int *segmentList;
+    int segmentCapacity;
+
+    //Buckets of an MSD sort left to partition and the ones done (they only
+    //grow), and the digit starts of the last bucket partitioned (apart from
+    //digits, as their write doesn't block)
+    int *msdStack;
+    int msdStackCapacity;
+    int *msdLeaves;
+    int msdLeavesCapacity;
+    int *msdStarts;
+
+    //Values of a sort with few distinct keys (as found on its sample, in
+    //ascending order): their order-preserving bits, the keys themselves,
+    //the table count_keys searches (encoded keys) and their counts, plus
+    //the flag of keys of other values
+    uint64_t distinctBits[DISTINCT_KEYS];
+    unsigned char distinctKeys[DISTINCT_KEYS * sizeof(cl_ulong)];
+    unsigned char distinctTable[DISTINCT_KEYS * sizeof(cl_ulong)];
+    int distinctCounts[DISTINCT_KEYS + 1];
+    cl_mem distinct_buffer;
+    cl_mem distinct_counts_buffer;
+
+    //Session flags (RS_PROFILE...)
+    int flags;
+
+    //Sorts run in the caller's arrays (host-unified devices or RS_ZERO_COPY)
+    int zeroCopy;
+
+    //Key type (RS_INT32...), its size in bytes and the passes it needs
+    int keyType;
+    int keySize;
+    int passes;
+
+    //Bits per digit and buckets per pass
+    int radix;
+    int buckets;
+
+    //Digit counts (then starts) of every pass, laid out [pass][bucket],
+    //and the passes a histogram launch can count in local memory
+    int *digits;
+    int histogramPasses;
+
+    //Checksums and keys out of order of the last sort (RS_VERIFY)
+    cl_mem check_buffer;
+    cl_uint check[CHECK_WORDS];
+
+    //Look-back state of the reorder tiles (created on first use, it only
+    //grows): the region the next pass uses, the tiles used of each region
+    //since it was cleared and the tile tickets handed out
+    cl_mem state_buffer;
+    int stateTiles;
+    int stateRegion;
+    int stateDirty[2];
+    cl_uint stateTickets;
+
+    //Profiling records of the last sort
+    rs_prof *prof;
+    int nprof;
+    int profcap;
+    int lastSize;
+    int lastValueSize;
+};
+
+
+//Names of the profiled stages, indexed by RS_STAGE_*
+static const char *rs_stage_names[RS_STAGES] = {
+    "write", "histogram", "reorder", "read", "verify"
+};
+
+//Returns the event to attach to the next enqueue (NULL if not profiling)
+static cl_event *rs_event(rs_session *s, int stage, int pass) {
+    if(!(s->flags & RS_PROFILE))
+        return NULL;
+    if(s->nprof == s->profcap) {
+        s->profcap = s->profcap ? 2 * s->profcap : 64;
+        s->prof = (rs_prof*)realloc(s->prof, s->profcap * sizeof(rs_prof));
     }
-    printf("\nCantidad de elementos en sorted: %d\n", i);
-    printf("\n\n");
-  
-    return 0;
+    rs_prof *p = &s->prof[s->nprof++];
+    p->stage = stage;
+    p->pass = pass;
+    p->event = NULL;
+    return &p->event;
 }
 
+//Gathers the timestamps of the last sort and releases its events
+static void rs_collect(rs_session *s) {
+    int i;
+    for(i = 0; i < s->nprof; i++) {
+        rs_prof *p = &s->prof[i];
+        clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &p->queued, NULL);
+        clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &p->submit, NULL);
+        clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &p->start, NULL);
+        clGetEventProfilingInfo(p->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &p->end, NULL);
+        clReleaseEvent(p->event);
+        p->event = NULL;
+    }
+}
 
-//Function to determine a file size (from the current cursor pos.)
-int filesize(FILE *fp) {
-    int prev=ftell(fp);
-    fseek(fp, 0L, SEEK_END);
-    int size = ftell(fp);
-    fseek(fp, prev, SEEK_SET); //return cursor to prev. pos.
-    return size;
+//Bytes of global memory moved by a stage of the last sort (reads plus writes)
+static double rs_stage_bytes(rs_session *s, int stage) {
+    double data = (double)s->keySize * s->lastSize;
+    switch(stage) {
+        case RS_STAGE_WRITE:
+        case RS_STAGE_READ:
+        case RS_STAGE_HISTOGRAM:
+        case RS_STAGE_VERIFY:
+            return data;
+        case RS_STAGE_REORDER:
+            return 2 * (data + (double)s->lastValueSize * s->lastSize);
+    }
+    return 0;
 }
 
 
 //**********************************************
-// radixsort
+// rs_session_report
 //
-//   Takes an int array pointer an its size and
-//   returns a sorted array
+//   Prints the profile of the last sort as a
+//   JSON object (needs RS_PROFILE)
 //**********************************************
-int *radixsort(int *array, int size) {
-
-    //Disable caching for nvidia, helps with .h files included in kernel
-    setenv("CUDA_CACHE_DISABLE", "1", 1);
+void rs_session_report(rs_session *s, FILE *out) {
+    int i, stage;
 
-    //----------------------
-    // Initialize host data
-    //----------------------
-    int *output = NULL; //Output array
-    size_t array_dataSize = sizeof(int)*size;
-    output = (int*)malloc(array_dataSize);
+    if(!(s->flags & RS_PROFILE) || s->nprof == 0) {
+        fprintf(out, "{}\n");
+        return;
+    }
 
-    //Allocate space for the arrays
+    cl_ulong first = s->prof[0].start, last = s->prof[0].end;
+    for(i = 0; i < s->nprof; i++) {
+        if(s->prof[i].start < first)
+            first = s->prof[i].start;
+        if(s->prof[i].end > last)
+            last = s->prof[i].end;
+    }
 
-    cl_int errNum;
+    fprintf(out, "{\"keys\":%d,\"bytes\":%zu,\"total_ns\":%" PRIu64 ",\"keys_per_sec\":%.1f,\"phases\":{",
+            s->lastSize, (size_t)s->keySize * s->lastSize, (uint64_t)(last - first),
+            last > first ? s->lastSize * 1e9 / (last - first) : 0.0);
+
+    //Per-phase totals
+    for(stage = 0; stage < RS_STAGES; stage++) {
+        cl_ulong ns = 0;
+        int calls = 0;
+        for(i = 0; i < s->nprof; i++) {
+            if(s->prof[i].stage == stage) {
+                ns += s->prof[i].end - s->prof[i].start;
+                calls++;
+            }
+        }
+        double bytes = calls * rs_stage_bytes(s, stage);
+        fprintf(out, "%s\"%s\":{\"calls\":%d,\"ns\":%" PRIu64 ",\"bytes\":%.0f,\"gbps\":%.3f}",
+                stage ? "," : "", rs_stage_names[stage], calls, (uint64_t)ns, bytes, ns ? bytes / ns : 0.0);
+    }
 
-    //----------------
-    // Import kernels
-    //----------------
-    FILE *fp;
-    const char file_name[] = KERNELS_FILENAME;
-    size_t file_sourceSize;
-    char *file_sourceStr;
-
-    fp = fopen(file_name, "r");
-    if(!fp) {
-        printf("Error opening the kernels file: [%s]\n", file_name);
-        exit(1);
+    //Per-pass totals (kernels only)
+    int pass, npasses = 0;
+    for(i = 0; i < s->nprof; i++)
+        if(s->prof[i].pass + 1 > npasses)
+            npasses = s->prof[i].pass + 1;
+    fprintf(out, "},\"passes\":[");
+    for(pass = 0; pass < npasses; pass++) {
+        cl_ulong ns = 0;
+        for(i = 0; i < s->nprof; i++)
+            if(s->prof[i].pass == pass)
+                ns += s->prof[i].end - s->prof[i].start;
+        fprintf(out, "%s{\"pass\":%d,\"ns\":%" PRIu64 "}", pass ? "," : "", pass, (uint64_t)ns);
     }
-    file_sourceSize = filesize(fp);
-    file_sourceStr = (char*)malloc(file_sourceSize);
-    if(file_sourceSize != fread(file_sourceStr, 1, file_sourceSize, fp)) {
-        printf("Error reading the kernels file: [%s]\n", file_name);
-        exit(1);
+
+    //Every enqueued command
+    fprintf(out, "],\"events\":[");
+    for(i = 0; i < s->nprof; i++) {
+        rs_prof *p = &s->prof[i];
+        fprintf(out, "%s{\"stage\":\"%s\",\"pass\":%d,\"queued\":%" PRIu64 ",\"submit\":%" PRIu64
+                ",\"start\":%" PRIu64 ",\"end\":%" PRIu64 ",\"gbps\":%.3f}",
+                i ? "," : "", rs_stage_names[p->stage], p->pass,
+                (uint64_t)(p->queued - first), (uint64_t)(p->submit - first),
+                (uint64_t)(p->start - first), (uint64_t)(p->end - first),
+                p->end > p->start ? rs_stage_bytes(s, p->stage) / (p->end - p->start) : 0.0);
     }
-    fclose(fp);
+    fprintf(out, "]}\n");
+}
+
 
+//**********************************************
+// rs_session_create
+//
+//   Creates a session on the first device of
+//   the first platform, or a native one when
+//   asked for or without openCL
+//**********************************************
+rs_session *rs_session_create(int keyType, int flags) {
+
+    cl_int errNum;
+
+    //Native backend when asked for
+    const char *backend = getenv("RS_BACKEND");
+    if((flags & RS_NATIVE) || (backend && strcmp(backend, "native") == 0))
+        return rs_session_create_native(keyType, flags);
 
     //----------------------
     // Obtain platform info
     //----------------------
     cl_uint numPlatforms = 0;
-    cl_platform_id *platforms = NULL;
 
-    //Obtain platform number (mockcall)
+    //Obtain platform number (mockcall), without openCL sort natively
     errNum = clGetPlatformIDs(0, NULL, &numPlatforms);
+    if(!errNum == CL_SUCCESS || numPlatforms == 0)
+        return rs_session_create_native(keyType, flags);
     //Alloc space per platform
-    platforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
+    cl_platform_id *platforms = (cl_platform_id*)malloc(numPlatforms*sizeof(cl_platform_id));
     //Fill with platform info
     errNum = clGetPlatformIDs(numPlatforms, platforms, NULL);
 
     //--------------------
     // Obtain device info
     //--------------------
-    cl_uint numDevices = 0;
-    cl_device_id *devices = NULL;
+    cl_device_id device;
+    errNum = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 1, &device, NULL);
+    free(platforms);
+    if(!errNum == CL_SUCCESS)
+        return rs_session_create_native(keyType, flags);
+
+    return rs_session_create_on(device, keyType, flags);
+}
+
+
+//Session for keyType keys, with its digit layout
+static rs_session *rs_session_new(int keyType, int flags) {
+    rs_session *s = (rs_session*)calloc(1, sizeof(rs_session));
+    s->flags = flags;
+    s->keyType = keyType;
+    s->keySize = KEY_SIZE(keyType);
+    s->radix = RS_RADIX_BITS(flags) ? RS_RADIX_BITS(flags) : RADIX;
+    if(s->radix != 4 && s->radix != 6 && s->radix != 8 && s->radix != 11) {
+        printf("Unsupported radix width: %d bits\n", s->radix);
+        exit(1);
+    }
+    s->buckets = 1 << s->radix;
+    //The last digit may be narrower than the others
+    s->passes = (s->keySize * 8 + s->radix - 1) / s->radix;
+    return s;
+}
+
+
+//**********************************************
+// rs_session_create_native
+//
+//   Creates a session that sorts on host
+//   threads (see nativesort.c)
+//**********************************************
+rs_session *rs_session_create_native(int keyType, int flags) {
+    rs_session *s = rs_session_new(keyType, flags);
+    s->native = 1;
+    return s;
+}
+
+
+//**********************************************
+// rs_session_open
+//
+//   Sets up the openCL environment on device,
+//   builds the program for keyType keys and
+//   creates the kernels once. A session opened
+//   with shared takes its context and program
+//   instead (but its own queue, kernels and
+//   buffers)
+//**********************************************
+static rs_session *rs_session_open(cl_device_id device, rs_session *shared, int keyType, int flags) {
+
+    //Disable caching for nvidia, helps with .h files included in kernel
+    //(rs_build_program keeps its own cache, keyed on the included headers too)
+    setenv("CUDA_CACHE_DISABLE", "1", 1);
 
-    //Obtain device number(mockcall)
-    errNum = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 0, NULL, &numDevices);
-    //Alloc device spaces
-    devices = (cl_device_id*)malloc(numDevices*sizeof(cl_device_id));
-    //Fill with device info
-    errNum = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, numDevices, devices, NULL);
+    rs_session *s = rs_session_new(keyType, flags);
+    s->device = device;
+
+    cl_int errNum;
 
 
 #ifdef PRINT
     //Print local memory sizes
     cl_ulong local_mem_size;
-    clGetDeviceInfo(devices[0], CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, 0);
+    clGetDeviceInfo(s->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, 0);
     int local_mem = local_mem_size;
     printf("\n\nLocal mem size: %d\n\n", local_mem);
 #endif
@@ -195,366 +371,1607 @@ int *radixsort(int *array, int size) {
     //----------------
     // Create context
     //----------------
-    cl_context context = NULL;
 
-    //Create device bound context
-    context = clCreateContext(NULL, numDevices, devices, NULL, NULL, &errNum);
+    //Create device bound context (or share it)
+    if(shared) {
+        s->context = shared->context;
+        clRetainContext(s->context);
+    }
+    else
+        s->context = clCreateContext(NULL, 1, &s->device, NULL, NULL, &errNum);
 
     //----------------------
     // Create command queue
     //----------------------
-    cl_command_queue commandQueue;
-    
-    commandQueue = clCreateCommandQueue(context, devices[0], 0, &errNum);
-
-    //----------------
-    // Create buffers
-    //----------------
-    cl_mem array_buffer;
-    cl_mem histo_buffer;
-    cl_mem scan_buffer;
-    cl_mem blocksum_buffer;
-    cl_mem output_buffer;
-
-    //Create input buff
-    array_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, array_dataSize, NULL, &errNum);
-    //Create histo buff
-    histo_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * BUCK * N_GROUPS * WG_SIZE, NULL, &errNum);
-    //Create scan buff
-    scan_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * BUCK * N_GROUPS * WG_SIZE, NULL, &errNum);
-    //Create blocksum buff
-    blocksum_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int) * N_GROUPS, NULL, &errNum);
-    //Create output buff
-    output_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, array_dataSize, NULL, &errNum);
-
-
-    //----------------------
-    // Enqueue device write (host -> device buffer)
-    //----------------------
-    
-    errNum = clEnqueueWriteBuffer(commandQueue, array_buffer, CL_FALSE, 0, array_dataSize, array, 0, NULL, NULL);
-    if(!errNum == CL_SUCCESS){
-        printf("Array buffer write terminated abruptly\n");
+    cl_command_queue_properties properties = (flags & RS_PROFILE) ? CL_QUEUE_PROFILING_ENABLE : 0;
+    s->commandQueue = clCreateCommandQueue(s->context, s->device, properties, &errNum);
+
+    //-------------------------
+    // Size the work-group grid
+    //-------------------------
+
+    s->maxGroups = MAX_GROUPS;
+
+    //The reorder tiles (two of keys, two of indices) and its digit
+    //counters must fit in local memory
+    cl_ulong localMemSize;
+    clGetDeviceInfo(s->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, NULL);
+    size_t reorderLocal = 2 * (s->keySize + sizeof(int)) * WG_SIZE * TILE_KEYS + sizeof(int) * (WG_SIZE + 2 * s->buckets);
+    if(reorderLocal > localMemSize) {
+        printf("Radix width of %d bits needs %d bytes of local memory, the device has %d\n", s->radix, (int)reorderLocal, (int)localMemSize);
         exit(1);
     }
-    clFinish(commandQueue);
+
+    //Segments sorted in local memory take two copies of their keys, as
+    //many as fit (a power of two, at least the reductions of two keys per item)
+    s->segmentKeys = 2 * WG_SIZE;
+    while(2 * (size_t)s->keySize * 2 * s->segmentKeys + sizeof(int) * WG_SIZE <= localMemSize)
+        s->segmentKeys *= 2;
+
+    //Devices that share the host memory sort in the caller's arrays
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(s->device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool), &unified, NULL);
+    s->zeroCopy = (flags & RS_ZERO_COPY) || unified;
+
+    //-----------------------
+    // Create fixed buffers
+    //-----------------------
+
+    //Create digits buff (counts and starts of every pass)
+    s->digits = (int*)calloc(s->passes * s->buckets, sizeof(int));
+    s->msdStarts = (int*)calloc(s->buckets, sizeof(int));
+    s->digits_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, sizeof(int) * s->passes * s->buckets, NULL, &errNum);
+    //Create verification buff
+    s->check_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, sizeof(s->check), NULL, &errNum);
+    //Create distinct values buffs (the table and its counts)
+    s->distinct_buffer = clCreateBuffer(s->context, CL_MEM_READ_ONLY, s->keySize * DISTINCT_KEYS, NULL, &errNum);
+    s->distinct_counts_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, sizeof(s->distinctCounts), NULL, &errNum);
+    //Input, output and look-back state buffers are created on demand by rs_session_sort
+    s->state_buffer = NULL;
+    s->stateTiles = 0;
+    s->array_buffer = NULL;
+    s->output_buffer = NULL;
+    s->capacity = 0;
 
     //----------------------------
-    // Create and compile program
+    // Build program (or load it from the cache)
     //----------------------------
-    cl_program program = NULL;
-    
-    //Create program from file
-    program = clCreateProgramWithSource(context, 1, (const char**)&file_sourceStr, (const size_t*)&file_sourceSize, &errNum);
-    if(!errNum == CL_SUCCESS){
-        printf("Error obtaining program from source. Using \"clCreateProgramWithSource\"\n");
-        exit(1);
-    }
 
-    //Compile for openCL 1.1
-    errNum = clBuildProgram(program, 1, devices, "-I. -cl-std=CL1.1", NULL, NULL);
-    if(!errNum == CL_SUCCESS){
-        printf("Error building program. Using \"clBuildProgram\"\n");
-        if(errNum == CL_BUILD_PROGRAM_FAILURE){
-            printf("Failure to build the program executable\n");
-            size_t log_size;
-            clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-            char *log = (char *) malloc(log_size);
-            clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
-            printf("*** BUILD INFO LOG *** \n%s\n", log);
-            free(log);
-        }
-        exit(1);
+    if(shared) {
+        s->program = shared->program;
+        clRetainProgram(s->program);
+    }
+    else {
+        //Compile for openCL 1.1, specialized for the key type, the digits and
+        //the loads that suit the device (loop bounds and shifts are constants)
+        //The kernels and the header they include are read from KERNELS_DIR
+        //(RS_KERNELS_DIR overrides it, for programs that link the library)
+        const char *kernels_dir = getenv("RS_KERNELS_DIR");
+        if(!kernels_dir)
+            kernels_dir = KERNELS_DIR;
+        char kernels_file[1024];
+        snprintf(kernels_file, sizeof(kernels_file), "%s/%s", kernels_dir, KERNELS_FILENAME);
+        char options[1280];
+        snprintf(options, sizeof(options), "-I%s -cl-std=CL1.1 -DKEY_TYPE=%d -DRADIX=%d -DWG_SIZE=%d -DTILE_KEYS=%d -DVECTOR_KEYS=%d -DVERIFY=%d",
+                 kernels_dir, keyType, s->radix, WG_SIZE, TILE_KEYS, rs_vector_keys(s->device, s->keySize), (flags & RS_VERIFY) ? 1 : 0);
+        s->program = rs_build_program(s->context, s->device, kernels_file, options);
     }
 
     //----------------
     // Create kernels
     //----------------
 
-    cl_kernel count, scan, blocksum, coalesce, reorder;
-    count = clCreateKernel(program, "count", &errNum);
+    s->histogram = clCreateKernel(s->program, "histogram", &errNum);
     if(!errNum == CL_SUCCESS){
-        printf("Error creating count kernel\n");
+        printf("Error creating histogram kernel\n");
         exit(1);
     }
-    scan = clCreateKernel(program, "scan", &errNum);
+    s->reorder = (cl_kernel*)malloc(s->passes * sizeof(cl_kernel));
+    int pass;
+    for(pass = 0; pass < s->passes; pass++) {
+        char name[MAX_KERNEL_NAME];
+        snprintf(name, sizeof(name), "reorder_%d", pass);
+        s->reorder[pass] = clCreateKernel(s->program, name, &errNum);
+        if(!errNum == CL_SUCCESS){
+            printf("Error creating %s kernel\n", name);
+            exit(1);
+        }
+    }
+    s->segments = clCreateKernel(s->program, "sort_segments", &errNum);
     if(!errNum == CL_SUCCESS){
-        printf("Error creating scan kernel\n");
+        printf("Error creating sort_segments kernel\n");
         exit(1);
     }
-    blocksum = clCreateKernel(program, "scan", &errNum);
+    s->count = clCreateKernel(s->program, "count_keys", &errNum);
     if(!errNum == CL_SUCCESS){
-        printf("Error creating blocksum kernel\n");
+        printf("Error creating count_keys kernel\n");
         exit(1);
     }
-    coalesce = clCreateKernel(program, "coalesce", &errNum);
+    s->select = clCreateKernel(s->program, "select_digits", &errNum);
     if(!errNum == CL_SUCCESS){
-        printf("Error creating coalesce kernel\n");
+        printf("Error creating select_digits kernel\n");
         exit(1);
     }
-    reorder = clCreateKernel(program, "reorder", &errNum);
+    s->gather = clCreateKernel(s->program, "gather_keys", &errNum);
     if(!errNum == CL_SUCCESS){
-        printf("Error creating reorder kernel\n");
+        printf("Error creating gather_keys kernel\n");
+        exit(1);
+    }
+    if(flags & RS_VERIFY) {
+        s->verify = clCreateKernel(s->program, "verify", &errNum);
+        if(!errNum == CL_SUCCESS){
+            printf("Error creating verify kernel\n");
+            exit(1);
+        }
+    }
+
+    //The histogram counts as many passes per launch as fit in the local
+    //memory left by its own variables and the implementation (what it
+    //takes before its local histograms are set)
+    cl_ulong histogramLocal = 0;
+    errNum = clGetKernelWorkGroupInfo(s->histogram, s->device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &histogramLocal, NULL);
+    if(!errNum == CL_SUCCESS || histogramLocal + sizeof(int) * s->buckets > localMemSize){
+        printf("Error sizing the histogram local memory\n");
         exit(1);
     }
+    s->histogramPasses = (localMemSize - histogramLocal) / (sizeof(int) * s->buckets);
+    if(s->histogramPasses > s->passes)
+        s->histogramPasses = s->passes;
 
     //-------------------------------
     // Set kernels constant arguments
     //-------------------------------
 
-    //Count fixed args
-    size_t CountGlobalWorkSize = N_GROUPS * WG_SIZE;
-    size_t CountLocalWorkSize = WG_SIZE;
-    errNum = clSetKernelArg(count, 2, sizeof(int)*BUCK*WG_SIZE, NULL);  // Local Histogram
-    errNum |= clSetKernelArg(count, 4, sizeof(int), &size);           // Number of elements in array
-
-    //Scan fixed args
-    size_t ScanGlobalWorkSize = (BUCK * N_GROUPS * WG_SIZE) / 2;
-    size_t ScanLocalWorkSize = ScanGlobalWorkSize / N_GROUPS;
-    errNum = clSetKernelArg(scan, 1, sizeof(cl_mem), &scan_buffer);       // Output array
-    errNum |= clSetKernelArg(scan, 2, sizeof(int)*BUCK*WG_SIZE, NULL);    // Local Scan
-    errNum |= clSetKernelArg(scan, 3, sizeof(cl_mem), &blocksum_buffer);  // Block Sum
-
-    //Blocksum fixed args
-    size_t BlocksumGlobalWorkSize = N_GROUPS / 2;
-    size_t BlocksumLocalWorkSize =  N_GROUPS / 2;
-    void* ptr = NULL;
-    errNum = clSetKernelArg(blocksum, 0, sizeof(cl_mem), &blocksum_buffer);   // Input array
-    errNum |= clSetKernelArg(blocksum, 1, sizeof(cl_mem), &blocksum_buffer);  // Output array
-    errNum |= clSetKernelArg(blocksum, 2, sizeof(int)*N_GROUPS, NULL);        // Local Scan
-    errNum |= clSetKernelArg(blocksum, 3, sizeof(cl_mem), ptr);               // Block Sum (null)
-
-    //Coalesce fixed args
-    size_t CoalesceGlobalWorkSize = (BUCK * N_GROUPS * WG_SIZE) / 2;
-    size_t CoalesceLocalWorkSize = CoalesceGlobalWorkSize / N_GROUPS;
-    errNum = clSetKernelArg(coalesce, 0, sizeof(cl_mem), &scan_buffer);      // Scan array
-    errNum |= clSetKernelArg(coalesce, 1, sizeof(cl_mem), &blocksum_buffer);  // Block reductions
+    //Histogram fixed args
+    errNum = clSetKernelArg(s->histogram, 1, sizeof(cl_mem), &s->digits_buffer);                    // Output array
+    errNum |= clSetKernelArg(s->histogram, 2, sizeof(int)*s->buckets*s->histogramPasses, NULL);     // Local Histograms
+    errNum |= clSetKernelArg(s->histogram, 7, sizeof(int), &s->histogramPasses);                    // Passes per launch
 
-    //Reorder fixed args
-    size_t ReorderGlobalWorkSize = N_GROUPS * WG_SIZE;
-    size_t ReorderLocalWorkSize = WG_SIZE;
-    errNum = clSetKernelArg(reorder, 1, sizeof(cl_mem), &scan_buffer);    //Prefix Sum array
-    errNum |= clSetKernelArg(reorder, 4, sizeof(int), &size);            // Number of elements in array
-    errNum |= clSetKernelArg(reorder, 5, sizeof(int)*BUCK*WG_SIZE, NULL);  // Local Histogram
+    //Segment sort fixed args
+    errNum = clSetKernelArg(s->segments, 4, s->keySize*2*s->segmentKeys, NULL);  // Local segment copies
+    errNum |= clSetKernelArg(s->segments, 5, sizeof(int)*WG_SIZE, NULL);          // Local item sums
+    errNum |= clSetKernelArg(s->segments, 6, sizeof(int), &s->segmentKeys);
 
+    //Distinct keys count fixed args
+    errNum = clSetKernelArg(s->count, 2, sizeof(cl_mem), &s->distinct_buffer);          // Values table
+    errNum |= clSetKernelArg(s->count, 4, sizeof(cl_mem), &s->distinct_counts_buffer); // Value counts
+    errNum |= clSetKernelArg(s->count, 5, s->keySize*DISTINCT_KEYS, NULL);              // Local values table
+    errNum |= clSetKernelArg(s->count, 6, sizeof(int)*DISTINCT_KEYS, NULL);             // Local value counts
 
-    //-------------------------------
-    // Enqueue kernels for execution
-    //-------------------------------
+    //Select fixed args (the digit counts, then the keys kept, go on digits_buffer)
+    errNum = clSetKernelArg(s->select, 5, sizeof(cl_mem), &s->digits_buffer);  // Digit counts
+    errNum |= clSetKernelArg(s->select, 6, sizeof(int)*s->buckets, NULL);      // Local digit counts
+    errNum |= clSetKernelArg(s->gather, 3, sizeof(cl_mem), &s->digits_buffer); // Keys gathered
 
-    int pass;
-#ifdef DEBUG //Do only DEBUG passes
-    for(pass = 0; pass < DEBUG; pass++){
-#else        //Operate normaly
-    for(pass = 0; pass < BITS/RADIX; pass++){
-#endif
-#ifdef PRINT
-        printf("Currently on pass:[%d]\n",pass);
-#endif
+    //Verify fixed args
+    if(flags & RS_VERIFY)
+        errNum = clSetKernelArg(s->verify, 1, sizeof(cl_mem), &s->check_buffer);
 
-        //Count arguments
-        errNum = clSetKernelArg(count, 0, sizeof(cl_mem), &array_buffer);   // Input array
-        errNum |= clSetKernelArg(count, 1, sizeof(cl_mem), &histo_buffer);  // Output array
-        errNum |= clSetKernelArg(count, 3, sizeof(int), &pass);             // Pass number
-        errNum = clEnqueueNDRangeKernel(commandQueue, count, 1, NULL, &CountGlobalWorkSize, &CountLocalWorkSize, 0, NULL, NULL);
-        if(!errNum == CL_SUCCESS){
-            printf("Count kernel terminated abruptly\n");
-            switch(errNum) {
-                case CL_INVALID_KERNEL_ARGS:
-                    printf("Invalid kernel args\n");
-                    break;
-                case CL_OUT_OF_RESOURCES:
-                    printf("Out of resources\n");
-                    break;
-                case CL_MEM_OBJECT_ALLOCATION_FAILURE:
-                    printf("Memobject allocation failure\n");
-                    break;
-                default:
-                    printf("Unspecified case\n");
-            }
- 
-            exit(1);
-        }
-        clFinish(commandQueue);
-    #ifdef DEBUG
-        int* countput;
-        countput = (int*)malloc(sizeof(int)*BUCK*WG_SIZE*N_GROUPS);
-        errNum = clEnqueueReadBuffer(commandQueue, histo_buffer, CL_TRUE, 0, sizeof(int)*BUCK*WG_SIZE*N_GROUPS, countput, 0, NULL, NULL);
-        clFinish(commandQueue);
-    #endif
+    //Reorder fixed args
+    for(pass = 0; pass < s->passes; pass++) {
+        cl_kernel reorder = s->reorder[pass];
+        errNum = clSetKernelArg(reorder, 1, sizeof(cl_mem), &s->digits_buffer);         // Digit starts
+        errNum |= clSetKernelArg(reorder, 4, sizeof(int)*s->buckets, NULL);            // Local digit starts
+        errNum |= clSetKernelArg(reorder, 9, 2*s->keySize*WG_SIZE*TILE_KEYS, NULL);    // Local tiles
+        errNum |= clSetKernelArg(reorder, 10, 2*sizeof(int)*WG_SIZE*TILE_KEYS, NULL);  // Local tile indices
+        errNum |= clSetKernelArg(reorder, 11, sizeof(int)*WG_SIZE, NULL);              // Local item sums
+        errNum |= clSetKernelArg(reorder, 12, sizeof(int)*s->buckets, NULL);           // Local digit bases
+    }
 
+    return s;
+}
 
-        //Scan arguments
-        errNum = clSetKernelArg(scan, 0, sizeof(cl_mem), &histo_buffer);      // Input array
-        errNum = clEnqueueNDRangeKernel(commandQueue, scan, 1, NULL, &ScanGlobalWorkSize, &ScanLocalWorkSize, 0, NULL, NULL);
-        if(!errNum == CL_SUCCESS){
-            printf("Scan kernel terminated abruptly\n");
-            switch(errNum) {
-                case CL_INVALID_KERNEL_ARGS:
-                    printf("Invalid kernel args\n");
-                    break;
-                default:
-                    printf("Unspecified case\n");
-            }
-                
-            exit(1);
-        }
-        clFinish(commandQueue);
-    #ifdef DEBUG
-        int* scanput;
-        scanput = (int*)malloc(sizeof(int)*BUCK*WG_SIZE*N_GROUPS);
-        errNum = clEnqueueReadBuffer(commandQueue, histo_buffer, CL_TRUE, 0, sizeof(int)*BUCK*WG_SIZE*N_GROUPS, scanput, 0, NULL, NULL);
-        int* oblockput;
-        oblockput = (int*)malloc(sizeof(int)*N_GROUPS);
-        errNum = clEnqueueReadBuffer(commandQueue, blocksum_buffer, CL_TRUE, 0, sizeof(int)*N_GROUPS, oblockput, 0, NULL, NULL);
-        clFinish(commandQueue);
-    #endif
+//Session on device (see rs_session_open)
+rs_session *rs_session_create_on(cl_device_id device, int keyType, int flags) {
+    return rs_session_open(device, NULL, keyType, flags);
+}
 
+//Another session on the context and program of s, with its own queue and
+//buffers (native sessions get another native one)
+rs_session *rs_session_create_shared(rs_session *s) {
+    if(s->native)
+        return rs_session_create_native(s->keyType, s->flags);
+    return rs_session_open(s->device, s, s->keyType, s->flags);
+}
 
-        //Block Sum arguments
-        errNum = clEnqueueNDRangeKernel(commandQueue, blocksum, 1, NULL, &BlocksumGlobalWorkSize, &BlocksumLocalWorkSize, 0, NULL, NULL);
-        if(!errNum == CL_SUCCESS){
-            printf("Block Sum kernel terminated abruptly\n");
-            switch(errNum){
-                case CL_INVALID_KERNEL_ARGS:
-                    printf("Invalid kernel args\n");
-                    break;
-                default:
-                    printf("Unspecified case\n");
-            }
-            exit(1);
-        }
-        clFinish(commandQueue);
-    #ifdef DEBUG
-        int* blockput;
-        blockput = (int*)malloc(sizeof(int)*N_GROUPS);
-        errNum = clEnqueueReadBuffer(commandQueue, blocksum_buffer, CL_TRUE, 0, sizeof(int)*N_GROUPS, blockput, 0, NULL, NULL);
-        clFinish(commandQueue);
-    #endif
 
+//**********************************************
+// rs_session_max_keys
+//
+//   Most keys a sort can take on the session
+//   device: the two key buffers and the look-
+//   back state within 3/4 of its global memory,
+//   and each within its largest allocation
+//**********************************************
+int rs_session_max_keys(rs_session *s) {
+    cl_ulong globalMem, maxAlloc;
 
-        //Coalesce arguments
-        errNum = clEnqueueNDRangeKernel(commandQueue, coalesce, 1, NULL, &CoalesceGlobalWorkSize, &CoalesceLocalWorkSize, 0, NULL, NULL);
-        if(!errNum == CL_SUCCESS){
-            printf("Coalesce kernel terminated abruptly\n");
-            exit(1);
-        }
-        clFinish(commandQueue);
-    #ifdef DEBUG
-        int* coalput;
-        coalput = (int*)malloc(sizeof(int)*BUCK*WG_SIZE*N_GROUPS);
-        errNum = clEnqueueReadBuffer(commandQueue, scan_buffer, CL_TRUE, 0, sizeof(int)*BUCK*WG_SIZE*N_GROUPS, coalput, 0, NULL, NULL);
-        clFinish(commandQueue);
-    #endif
+    //Native sorts take a scratch copy of the keys in host memory
+    if(s->native) {
+        cl_ulong keys = (cl_ulong)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 4 / (2 * s->keySize);
+        return keys > LOOKBACK_MAX_KEYS ? LOOKBACK_MAX_KEYS : (int)keys;
+    }
+    clGetDeviceInfo(s->device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMem, NULL);
+    clGetDeviceInfo(s->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAlloc, NULL);
+
+    //Bytes per tile of keys
+    cl_ulong tileKeys = WG_SIZE * TILE_KEYS;
+    cl_ulong stateBytes = 2 * sizeof(int) * s->buckets;
+    cl_ulong keys = globalMem / 4 * 3 / (2 * s->keySize * tileKeys + stateBytes) * tileKeys;
+    if(keys > maxAlloc / s->keySize)
+        keys = maxAlloc / s->keySize;
+    if(keys > maxAlloc / stateBytes * tileKeys)
+        keys = maxAlloc / stateBytes * tileKeys;
+    if(keys > LOOKBACK_MAX_KEYS)
+        keys = LOOKBACK_MAX_KEYS;
+    return (int)keys;
+}
 
 
-        //Reorder arguments
-        errNum = clSetKernelArg(reorder, 0, sizeof(cl_mem), &array_buffer);       // Input array
-        errNum |= clSetKernelArg(reorder, 2, sizeof(cl_mem), &output_buffer);
-        errNum |= clSetKernelArg(reorder, 3, sizeof(int), &pass);                 // Pass number
-        errNum = clEnqueueNDRangeKernel(commandQueue, reorder, 1, NULL, &ReorderGlobalWorkSize, &ReorderLocalWorkSize, 0, NULL, NULL);
-        if(!errNum == CL_SUCCESS){
-            printf("Reorder kernel terminated abruptly\n");
-            switch(errNum) {
-                case CL_INVALID_KERNEL_ARGS:
-                    printf("Invalid kernel args\n");
-                    break;
-                default:
-                    printf("Unspecified case\n");
-            }
-                
-            exit(1);
-        }
-        clFinish(commandQueue);
+//**********************************************
+// rs_session_destroy
+//
+//   Frees every resource held by the session
+//**********************************************
+void rs_session_destroy(rs_session *s) {
 
+    if(s->native) {
+        rs_native_release(s->nativeWorkspace);
+        free(s);
+        return;
+    }
 
-        //Swap current array with newest array
-        cl_mem tmp = array_buffer;
-        array_buffer = output_buffer;
-        output_buffer = tmp;
+    //openCL
+    clReleaseKernel(s->histogram);
+    int pass;
+    for(pass = 0; pass < s->passes; pass++)
+        clReleaseKernel(s->reorder[pass]);
+    clReleaseKernel(s->segments);
+    clReleaseKernel(s->count);
+    clReleaseKernel(s->select);
+    clReleaseKernel(s->gather);
+    if(s->flags & RS_VERIFY)
+        clReleaseKernel(s->verify);
+
+    clReleaseProgram(s->program);
+    clReleaseCommandQueue(s->commandQueue);
+
+    if(s->array_buffer)
+        clReleaseMemObject(s->array_buffer);
+    if(s->output_buffer)
+        clReleaseMemObject(s->output_buffer);
+    if(s->value_buffer)
+        clReleaseMemObject(s->value_buffer);
+    if(s->value_output_buffer)
+        clReleaseMemObject(s->value_output_buffer);
+    clReleaseMemObject(s->digits_buffer);
+    clReleaseMemObject(s->check_buffer);
+    clReleaseMemObject(s->distinct_buffer);
+    clReleaseMemObject(s->distinct_counts_buffer);
+    if(s->state_buffer)
+        clReleaseMemObject(s->state_buffer);
+    if(s->segment_offsets_buffer)
+        clReleaseMemObject(s->segment_offsets_buffer);
+    if(s->segment_list_buffer)
+        clReleaseMemObject(s->segment_list_buffer);
+
+    clReleaseContext(s->context);
+    //Host
+    rs_native_release(s->nativeWorkspace);
+    free(s->prof);
+    free(s->digits);
+    free(s->reorder);
+    free(s->segmentBounds);
+    free(s->segmentList);
+    free(s->msdStack);
+    free(s->msdLeaves);
+    free(s->msdStarts);
+    free(s);
+}
 
-    }
 
-    //-------------------
-    // Enqueue host read (device buffer -> host)
-    //-------------------
-    
-    errNum = clEnqueueReadBuffer(commandQueue, output_buffer, CL_TRUE, 0, array_dataSize, output, 0, NULL, NULL);
-    clFinish(commandQueue);
-    
-    
-#ifdef DEBUG
-    int k;
-    printf("Arreglo Original:\n");
-    for(k=0; k<ARRLEN; k++) {
-        printf("[%d]", array[k]);
+//Work-groups of a read of size keys (a power of two, scaled with the input)
+static int rs_groups(rs_session *s, int size) {
+    int n_groups = 1;
+    while(n_groups < s->maxGroups && (size_t)n_groups * WG_SIZE * KEYS_PER_ITEM < (size_t)size)
+        n_groups *= 2;
+    return n_groups;
+}
+
+//Grows array_buffer and output_buffer to size bytes (if necessary)
+static void rs_reserve(rs_session *s, size_t size) {
+    cl_int errNum;
+    if(size <= s->capacity)
+        return;
+    if(s->array_buffer)
+        clReleaseMemObject(s->array_buffer);
+    if(s->output_buffer)
+        clReleaseMemObject(s->output_buffer);
+
+    //Create input buff
+    cl_mem_flags scratch = CL_MEM_READ_WRITE | (s->zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0);
+    s->array_buffer = clCreateBuffer(s->context, scratch, size, NULL, &errNum);
+    //Create output buff
+    s->output_buffer = clCreateBuffer(s->context, scratch, size, NULL, &errNum);
+    if(!errNum == CL_SUCCESS){
+        printf("Error creating the array buffers\n");
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Count:");
-    for(k=0; k<BUCK*WG_SIZE*N_GROUPS; k++) {
-        printf("[%d]", countput[k]);
+    s->capacity = size;
+}
+
+//Wraps host memory in a buffer for one zero-copy sort
+static cl_mem rs_wrap(rs_session *s, void *ptr, size_t size, cl_mem_flags flags) {
+    cl_int errNum;
+    cl_mem buffer = clCreateBuffer(s->context, flags | CL_MEM_USE_HOST_PTR, size, ptr, &errNum);
+    if(!errNum == CL_SUCCESS){
+        printf("Error wrapping the host array in a buffer\n");
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Scan:");
-    for(k=0; k<BUCK*WG_SIZE*N_GROUPS; k++) {
-        printf("[%d]", scanput[k]);
+    return buffer;
+}
+
+//Buffer a pass writes, out of the one it reads: the passes alternate so the
+//last one (remaining 1) writes target, if any, the others write a scratch
+static cl_mem rs_destination(cl_mem source, cl_mem target, cl_mem scratch0, cl_mem scratch1, int remaining) {
+    if(target && target != source && remaining % 2 == 1)
+        return target;
+    return source == scratch0 ? scratch1 : scratch0;
+}
+
+//Makes the sorted data in a zero-copy buffer (moving it there from the
+//buffer it ended on, if another) visible to the host
+static void rs_unwrap(rs_session *s, cl_mem last, cl_mem target, size_t size) {
+    cl_int errNum;
+    if(last != target)
+        errNum = clEnqueueCopyBuffer(s->commandQueue, last, target, 0, 0, size, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+    void *mapped = clEnqueueMapBuffer(s->commandQueue, target, CL_TRUE, CL_MAP_READ, 0, size, 0, NULL, NULL, &errNum);
+    if(!errNum == CL_SUCCESS){
+        printf("Error mapping the sorted array\n");
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Block Array:");
-    for(k=0; k<N_GROUPS; k++) {
-        printf("[%d]", oblockput[k]);
+    clEnqueueUnmapMemObject(s->commandQueue, target, mapped, 0, NULL, NULL);
+}
+
+
+//Grows a host array of the session to n ints at least (it only grows)
+static int *rs_grow_ints(int *array, int *capacity, int n) {
+    if(n <= *capacity)
+        return array;
+    *capacity = n > 2 * *capacity ? n : 2 * *capacity;
+    array = (int*)realloc(array, sizeof(int) * *capacity);
+    if(!array) {
+        printf("Error allocating %d ints\n", *capacity);
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Block Sum:");
-    for(k=0; k<N_GROUPS; k++) {
-        printf("[%d]", blockput[k]);
+    return array;
+}
+
+//Grows the segment bounds and list buffers, and their host copies, to n
+//entries (they only grow)
+static void rs_reserve_segments(rs_session *s, int n) {
+    cl_int errNum;
+    if(n <= s->segmentCapacity)
+        return;
+    if(s->segment_offsets_buffer)
+        clReleaseMemObject(s->segment_offsets_buffer);
+    if(s->segment_list_buffer)
+        clReleaseMemObject(s->segment_list_buffer);
+    s->segment_offsets_buffer = clCreateBuffer(s->context, CL_MEM_READ_ONLY, sizeof(int) * n, NULL, &errNum);
+    s->segment_list_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, sizeof(int) * n, NULL, &errNum);
+    if(!errNum == CL_SUCCESS){
+        printf("Error creating the segment buffers\n");
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Coalesce:");
-    for(k=0; k<BUCK*WG_SIZE*N_GROUPS; k++) {
-        printf("[%d]", coalput[k]);
+    int capacity = s->segmentCapacity;
+    s->segmentBounds = rs_grow_ints(s->segmentBounds, &capacity, n);
+    capacity = s->segmentCapacity;
+    s->segmentList = rs_grow_ints(s->segmentList, &capacity, n);
+    s->segmentCapacity = n;
+}
+
+//Enqueues the sort of the nlisted segments of the list on segment_list_buffer
+//(bounds on segment_offsets_buffer) from input into output, the groups
+//taking them off its ticket
+static void rs_enqueue_segments(rs_session *s, cl_mem input, cl_mem output, int nlisted) {
+    cl_int errNum;
+    int ngroups = nlisted < s->maxGroups ? nlisted : s->maxGroups;
+    size_t SegmentsGlobalWorkSize = (size_t)ngroups * WG_SIZE;
+    size_t SegmentsLocalWorkSize = WG_SIZE;
+    errNum = clSetKernelArg(s->segments, 0, sizeof(cl_mem), &input);
+    errNum |= clSetKernelArg(s->segments, 1, sizeof(cl_mem), &output);
+    errNum |= clSetKernelArg(s->segments, 2, sizeof(cl_mem), &s->segment_offsets_buffer);
+    errNum |= clSetKernelArg(s->segments, 3, sizeof(cl_mem), &s->segment_list_buffer);
+    errNum |= clSetKernelArg(s->segments, 7, sizeof(int), &nlisted);
+    errNum = clEnqueueNDRangeKernel(s->commandQueue, s->segments, 1, NULL, &SegmentsGlobalWorkSize, &SegmentsLocalWorkSize, 0, NULL, rs_event(s, RS_STAGE_REORDER, -1));
+    if(!errNum == CL_SUCCESS){
+        printf("Segment sort kernel terminated abruptly\n");
+        exit(1);
     }
-    printf("\n\n");
-    printf("Resultado Ordenado:");
-    for(k=0; k<ARRLEN; k++) {
-        printf("[%d]", output[k]);
+}
+
+//Enqueues the verify of the size sorted keys of input, over the histogram
+//grid, and the (non-blocking) read of its result into s->check. With
+//nbounds bounds on bounds, each segment is checked on its own
+static void rs_enqueue_verify(rs_session *s, cl_mem input, int size, cl_mem bounds, int nbounds) {
+    cl_int errNum;
+    size_t VerifyGlobalWorkSize = (size_t)rs_groups(s, size) * WG_SIZE;
+    size_t VerifyLocalWorkSize = WG_SIZE;
+    errNum = clSetKernelArg(s->verify, 0, sizeof(cl_mem), &input);  // Sorted array
+    errNum |= clSetKernelArg(s->verify, 2, sizeof(int), &size);
+    errNum |= clSetKernelArg(s->verify, 3, sizeof(cl_mem), &bounds);
+    errNum |= clSetKernelArg(s->verify, 4, sizeof(int), &nbounds);
+    errNum |= clEnqueueNDRangeKernel(s->commandQueue, s->verify, 1, NULL, &VerifyGlobalWorkSize, &VerifyLocalWorkSize, 0, NULL, rs_event(s, RS_STAGE_VERIFY, -1));
+    if(!errNum == CL_SUCCESS){
+        printf("Verify kernel terminated abruptly\n");
+        exit(1);
     }
-    printf("\n\n");
-#endif
+    errNum = clEnqueueReadBuffer(s->commandQueue, s->check_buffer, CL_FALSE, 0, sizeof(s->check), s->check, 0, NULL, NULL);
+}
 
-    //----------------
-    // Free resources
-    //----------------
-    //openCL
-    clReleaseKernel(count);
-    clReleaseKernel(scan);
-    clReleaseKernel(blocksum);
-    clReleaseKernel(coalesce);
-    clReleaseKernel(reorder);
-
-    clReleaseProgram(program);
-    clReleaseCommandQueue(commandQueue);
-    
-    clReleaseMemObject(array_buffer);
-    clReleaseMemObject(histo_buffer);
-    clReleaseMemObject(scan_buffer);
-    clReleaseMemObject(blocksum_buffer);
-    clReleaseMemObject(output_buffer);
+//Adds the check words of a sort to the ones of a batch
+static void rs_add_check(cl_uint *check, const cl_uint *sort) {
+    check[CHECK_SUM_IN] += sort[CHECK_SUM_IN];
+    check[CHECK_XOR_IN] ^= sort[CHECK_XOR_IN];
+    check[CHECK_SUM_OUT] += sort[CHECK_SUM_OUT];
+    check[CHECK_XOR_OUT] ^= sort[CHECK_XOR_OUT];
+    check[CHECK_INVERSIONS] += sort[CHECK_INVERSIONS];
+}
 
-    clReleaseContext(context);
-    //Host
-#ifdef DEBUG
-    free(countput);
-    free(scanput);
-    free(coalput);
-    free(oblockput);
-    free(blockput);   
-#endif
-    free(platforms);
-    free(devices);
-    
-    //---------------------
-    // Return sorted array
-    //---------------------
-    return output;
+
+//**********************************************
+// rs_count_digits
+//
+//   Counts the digits of the passes firstPass
+//   to lastPass of the size keys of input from
+//   offset on into s->digits (laid out [pass]
+//   [bucket]), in one read per histogramPasses
+//   passes. With checksum, the first read also
+//   adds the keys to the input checksums
+//**********************************************
+static void rs_count_digits(rs_session *s, cl_mem input, int offset, int size, int firstPass, int lastPass, int checksum) {
+    cl_int errNum;
+    cl_command_queue commandQueue = s->commandQueue;
+    size_t HistogramGlobalWorkSize = (size_t)rs_groups(s, size) * WG_SIZE;
+    size_t HistogramLocalWorkSize = WG_SIZE;
+    size_t countsOffset = sizeof(int) * firstPass * s->buckets;
+    size_t countsSize = sizeof(int) * (lastPass - firstPass + 1) * s->buckets;
+
+    //The histogram adds to the zeroed counts (the commands that read
+    //s->digits before finished on a blocking call, so it is free)
+    memset(s->digits + firstPass * s->buckets, 0, countsSize);
+    errNum = clEnqueueWriteBuffer(commandQueue, s->digits_buffer, CL_FALSE, countsOffset, countsSize, s->digits + firstPass * s->buckets, 0, NULL, NULL);
+    errNum |= clSetKernelArg(s->histogram, 0, sizeof(cl_mem), &input);  // Input array
+    errNum |= clSetKernelArg(s->histogram, 3, sizeof(int), &size);      // Number of elements in array
+    errNum |= clSetKernelArg(s->histogram, 6, sizeof(int), &offset);
+    int pass;
+    for(pass = firstPass; pass <= lastPass; pass += s->histogramPasses) {
+        cl_mem check = checksum && pass == firstPass ? s->check_buffer : NULL;
+        errNum |= clSetKernelArg(s->histogram, 4, sizeof(int), &pass);      // First pass
+        errNum |= clSetKernelArg(s->histogram, 5, sizeof(cl_mem), &check); // Input checksum (or none)
+        errNum |= clEnqueueNDRangeKernel(commandQueue, s->histogram, 1, NULL, &HistogramGlobalWorkSize, &HistogramLocalWorkSize, 0, NULL, rs_event(s, RS_STAGE_HISTOGRAM, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Histogram kernel terminated abruptly\n");
+            exit(1);
+        }
+    }
+    errNum = clEnqueueReadBuffer(commandQueue, s->digits_buffer, CL_TRUE, countsOffset, countsSize, s->digits + firstPass * s->buckets, 0, NULL, NULL);
+    if(!errNum == CL_SUCCESS){
+        printf("Histogram read terminated abruptly\n");
+        exit(1);
+    }
+}
+
+
+//**********************************************
+// rs_reorder
+//
+//   Enqueues the reorder of pass (its digit
+//   starts on digits_buffer) of the size keys
+//   of input from offset on into output, with
+//   the values as the reorder kernel takes them
+//**********************************************
+static void rs_reorder(rs_session *s, int pass, cl_mem input, cl_mem output, cl_mem values, cl_mem values_output, int valueWords, int passFlags, int size, int offset) {
+    cl_int errNum;
+    int ntiles = (size + WG_SIZE * TILE_KEYS - 1) / (WG_SIZE * TILE_KEYS);
+    size_t ReorderGlobalWorkSize = (size_t)ntiles * WG_SIZE;
+    size_t ReorderLocalWorkSize = WG_SIZE;
+
+    //Look-back state: this pass uses a clean region and clears the
+    //other one (as far as it was used) for the next pass
+    int region = s->stateRegion;
+    int used = 1 + region * s->stateTiles * s->buckets;
+    int clear = 1 + (1 - region) * s->stateTiles * s->buckets;
+    int nclear = s->stateDirty[1 - region] * s->buckets;
+    cl_kernel reorder = s->reorder[pass];
+    errNum = clSetKernelArg(reorder, 3, sizeof(int), &size);                  // Number of elements in array
+    errNum |= clSetKernelArg(reorder, 13, sizeof(cl_mem), &s->state_buffer);  // Look-back state
+    errNum |= clSetKernelArg(reorder, 14, sizeof(int), &used);                // Region used
+    errNum |= clSetKernelArg(reorder, 15, sizeof(cl_uint), &s->stateTickets); // First ticket
+    errNum |= clSetKernelArg(reorder, 16, sizeof(int), &clear);               // Region cleared
+    errNum |= clSetKernelArg(reorder, 17, sizeof(int), &nclear);
+    s->stateDirty[1 - region] = 0;
+    s->stateDirty[region] = ntiles;
+    s->stateRegion = 1 - region;
+    s->stateTickets += ntiles;
+
+    errNum = clSetKernelArg(reorder, 0, sizeof(cl_mem), &input);              // Input array
+    errNum |= clSetKernelArg(reorder, 2, sizeof(cl_mem), &output);
+    errNum |= clSetKernelArg(reorder, 5, sizeof(cl_mem), &values);
+    errNum |= clSetKernelArg(reorder, 6, sizeof(cl_mem), &values_output);
+    errNum |= clSetKernelArg(reorder, 7, sizeof(int), &valueWords);
+    errNum |= clSetKernelArg(reorder, 8, sizeof(int), &passFlags);            // First/last pass
+    errNum |= clSetKernelArg(reorder, 18, sizeof(int), &offset);              // First key
+    errNum = clEnqueueNDRangeKernel(s->commandQueue, reorder, 1, NULL, &ReorderGlobalWorkSize, &ReorderLocalWorkSize, 0, NULL, rs_event(s, RS_STAGE_REORDER, pass));
+    if(!errNum == CL_SUCCESS){
+        printf("Reorder kernel terminated abruptly\n");
+        switch(errNum) {
+            case CL_INVALID_KERNEL_ARGS:
+                printf("Invalid kernel args\n");
+                break;
+            default:
+                printf("Unspecified case\n");
+        }
+            
+        exit(1);
+    }
+}
+
+
+//Adds a bucket done to an MSD sort (sorted: its keys are in order already)
+static void rs_msd_done(rs_session *s, int *nleaves, int begin, int keys, int where, int sorted) {
+    s->msdLeaves = rs_grow_ints(s->msdLeaves, &s->msdLeavesCapacity, 4 * (*nleaves + 1));
+    int *leaf = s->msdLeaves + 4 * (*nleaves)++;
+    leaf[0] = begin;
+    leaf[1] = keys;
+    leaf[2] = where;
+    leaf[3] = sorted;
+}
+
+
+//**********************************************
+// rs_sort_msd
+//
+//   Sorts the keys (no values) on array_buffer
+//   into output from the top digit down. Each
+//   bucket is partitioned on its top varying
+//   digit by a histogram and one reorder of
+//   its range, into the other scratch buffer.
+//   The host schedules the partitions off its
+//   stack, with a blocking read of the counts
+//   per bucket (more if its top digits do not
+//   vary). The buckets of segmentKeys keys or
+//   less are left to sort in local memory, all
+//   of them in one launch per buffer where the
+//   groups take them off a queue. The sorted
+//   keys end up on output_buffer, verified
+//   there with RS_VERIFY
+//**********************************************
+static void rs_sort_msd(rs_session *s, cl_mem array_buffer, cl_mem array_target, void *output, int size) {
+
+    cl_int errNum = CL_SUCCESS;
+    cl_command_queue commandQueue = s->commandQueue;
+    size_t array_dataSize = (size_t)s->keySize * size;
+
+    //Where a bucket is: the input, output_buffer or array_buffer (the
+    //partitions alternate between the last two)
+    cl_mem buffers[3] = {array_buffer, s->output_buffer, s->array_buffer};
+
+    //-----------------------------------------
+    // Partition the buckets over segmentKeys
+    //-----------------------------------------
+
+    //Buckets left (begin, keys, top pass left and where each) and done
+    //(begin, keys, where and whether sorted already)
+    int nstack = 1, nleaves = 0, i, d;
+    int checksum = s->flags & RS_VERIFY;
+    if(checksum)
+        errNum = clEnqueueWriteBuffer(commandQueue, s->check_buffer, CL_FALSE, 0, sizeof(s->check), s->check, 0, NULL, NULL);
+    s->msdStack = rs_grow_ints(s->msdStack, &s->msdStackCapacity, 4);
+    s->msdStack[0] = 0;
+    s->msdStack[1] = size;
+    s->msdStack[2] = s->passes - 1;
+    s->msdStack[3] = 0;
+    while(nstack > 0) {
+        nstack--;
+        int begin = s->msdStack[4 * nstack], keys = s->msdStack[4 * nstack + 1];
+        int pass = s->msdStack[4 * nstack + 2], from = s->msdStack[4 * nstack + 3];
+
+        //Top digit that varies in the bucket (none: its keys are all equal).
+        //The digits above it are the bucket's, so the counting starts at the
+        //next one and goes down a histogram launch at a time, one read each
+        int low = pass + 1;
+        do {
+            int high = low - 1;
+            low = high >= s->histogramPasses ? high - s->histogramPasses + 1 : 0;
+            rs_count_digits(s, buffers[from], begin, keys, low, high, checksum);
+            checksum = 0;
+            for(pass = high; pass >= low; pass--) {
+                int *counts = s->digits + pass * s->buckets;
+                for(d = 0; d < s->buckets && counts[d] != keys; d++);
+                if(d == s->buckets)
+                    break;
+            }
+        } while(pass < low && low > 0);
+        if(pass < 0) {
+            rs_msd_done(s, &nleaves, begin, keys, from, 1);
+            continue;
+        }
+
+        //Its buckets on that digit: the large ones are partitioned next
+        //(unless no digit is left), the others are done
+        int to = from == 1 ? 2 : 1;
+        int *counts = s->digits + pass * s->buckets;
+        int start = 0;
+        for(d = 0; d < s->buckets; d++) {
+            int count = counts[d];
+            if(count > s->segmentKeys && pass > 0) {
+                s->msdStack = rs_grow_ints(s->msdStack, &s->msdStackCapacity, 4 * (nstack + 1));
+                int *bucket = s->msdStack + 4 * nstack++;
+                bucket[0] = begin + start;
+                bucket[1] = count;
+                bucket[2] = pass - 1;
+                bucket[3] = to;
+            }
+            else if(count > 0)
+                rs_msd_done(s, &nleaves, begin + start, count, to, count == 1 || pass == 0);
+            s->msdStarts[d] = start;
+            start += count;
+        }
+
+        //Partition (the blocking read of the next count comes after the
+        //write, so msdStarts is free by the time it is reused)
+        errNum = clEnqueueWriteBuffer(commandQueue, s->digits_buffer, CL_FALSE, sizeof(int) * pass * s->buckets, sizeof(int) * s->buckets, s->msdStarts, 0, NULL, NULL);
+        rs_reorder(s, pass, buffers[from], buffers[to], NULL, NULL, 0, PASS_FIRST | PASS_LAST, keys, begin);
+    }
+
+    //-----------------------------------------
+    // Sort the small buckets in local memory
+    //-----------------------------------------
+
+    //Two lists, each after its ticket: the buckets on output_buffer, sorted
+    //in place, and the ones on array_buffer, sorted into output_buffer.
+    //Buckets done elsewhere (sorted already) are copied over
+    int listed[2] = {0, 0}, nlisted[2] = {0, 0}, nbounds = 0;
+    for(i = 0; i < nleaves; i++) {
+        int *leaf = s->msdLeaves + 4 * i;
+        if(leaf[2] == 1 && !leaf[3])
+            listed[0]++;
+        else if(leaf[2] == 2 && leaf[1] <= s->segmentKeys)
+            listed[1]++;
+    }
+    rs_reserve_segments(s, 2 * nleaves + 2);
+    int *list[2] = {s->segmentList, s->segmentList + listed[0] + 1};
+    list[0][0] = list[1][0] = 0;
+    for(i = 0; i < nleaves; i++) {
+        int *leaf = s->msdLeaves + 4 * i;
+        int begin = leaf[0], keys = leaf[1], where = leaf[2], sorted = leaf[3], l;
+        if(where == 1 && !sorted)
+            l = 0;
+        else if(where == 2 && keys <= s->segmentKeys)
+            l = 1;
+        else {
+            if(where != 1)
+                errNum = clEnqueueCopyBuffer(commandQueue, buffers[where], s->output_buffer, (size_t)s->keySize * begin, (size_t)s->keySize * begin, (size_t)s->keySize * keys, 0, NULL, NULL);
+            continue;
+        }
+        s->segmentBounds[nbounds] = begin;
+        s->segmentBounds[nbounds + 1] = begin + keys;
+        list[l][1 + nlisted[l]++] = nbounds;
+        nbounds += 2;
+    }
+    if(nbounds > 0)
+        errNum = clEnqueueWriteBuffer(commandQueue, s->segment_offsets_buffer, CL_FALSE, 0, sizeof(int) * nbounds, s->segmentBounds, 0, NULL, NULL);
+    for(i = 0; i < 2; i++) {
+        if(nlisted[i] == 0)
+            continue;
+        errNum = clEnqueueWriteBuffer(commandQueue, s->segment_list_buffer, CL_FALSE, 0, sizeof(int) * (nlisted[i] + 1), list[i], 0, NULL, NULL);
+        rs_enqueue_segments(s, buffers[i + 1], s->output_buffer, nlisted[i]);
+    }
+
+    //-----------------------------------------
+    // Verify the sorted keys (still on device)
+    //-----------------------------------------
+    if(s->flags & RS_VERIFY)
+        rs_enqueue_verify(s, s->output_buffer, size, NULL, 0);
+
+    //-------------------
+    // Enqueue host read
+    //-------------------
+    if(s->zeroCopy)
+        rs_unwrap(s, s->output_buffer, array_target, array_dataSize);
+    else
+        errNum = clEnqueueReadBuffer(commandQueue, s->output_buffer, CL_TRUE, 0, array_dataSize, output, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+    if(!errNum == CL_SUCCESS){
+        printf("MSD sort terminated abruptly\n");
+        exit(1);
+    }
+}
+
+
+//**********************************************
+// rs_sort_distinct
+//
+//   Sorts keys of few distinct values in one
+//   read: the values are found on a sample of
+//   array, count_keys counts the keys of each
+//   and output is written as one run per value.
+//   Returns 0 (and writes nothing) when the
+//   sample has more than DISTINCT_KEYS values
+//   or the keys have one the sample missed
+//**********************************************
+static int rs_sort_distinct(rs_session *s, cl_mem array_buffer, const void *array, void *output, int n_groups, int size) {
+
+    cl_int errNum;
+    int keySize = s->keySize;
+
+    //Values of the sample, kept in order as they are found
+    int nvalues = 0, i;
+    for(i = 0; i < DISTINCT_SAMPLES; i++) {
+        const unsigned char *key = (const unsigned char*)array + (size_t)keySize * ((size_t)i * size / DISTINCT_SAMPLES);
+        uint64_t bits = rs_key_bits(key, s->keyType);
+        int lo = 0, hi = nvalues;
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(s->distinctBits[mid] < bits)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if(lo < nvalues && s->distinctBits[lo] == bits)
+            continue;
+        if(nvalues == DISTINCT_KEYS)
+            return 0;
+        memmove(s->distinctBits + lo + 1, s->distinctBits + lo, sizeof(uint64_t) * (nvalues - lo));
+        memmove(s->distinctKeys + (size_t)keySize * (lo + 1), s->distinctKeys + (size_t)keySize * lo, (size_t)keySize * (nvalues - lo));
+        s->distinctBits[lo] = bits;
+        memcpy(s->distinctKeys + (size_t)keySize * lo, key, keySize);
+        nvalues++;
+    }
+
+    //Count the keys of each value on the histogram grid (the counts come
+    //back with the flag of keys of other values)
+    for(i = 0; i < nvalues; i++) {
+        if(keySize == 4)
+            ((cl_uint*)s->distinctTable)[i] = (cl_uint)s->distinctBits[i];
+        else
+            ((cl_ulong*)s->distinctTable)[i] = s->distinctBits[i];
+    }
+    memset(s->distinctCounts, 0, sizeof(int) * (nvalues + 1));
+    cl_command_queue commandQueue = s->commandQueue;
+    errNum = clEnqueueWriteBuffer(commandQueue, s->distinct_buffer, CL_FALSE, 0, (size_t)keySize * nvalues, s->distinctTable, 0, NULL, NULL);
+    errNum |= clEnqueueWriteBuffer(commandQueue, s->distinct_counts_buffer, CL_FALSE, 0, sizeof(int) * (nvalues + 1), s->distinctCounts, 0, NULL, NULL);
+    errNum |= clSetKernelArg(s->count, 0, sizeof(cl_mem), &array_buffer);  // Input array
+    errNum |= clSetKernelArg(s->count, 1, sizeof(int), &size);
+    errNum |= clSetKernelArg(s->count, 3, sizeof(int), &nvalues);
+    size_t globalWorkSize = (size_t)n_groups * WG_SIZE;
+    size_t localWorkSize = WG_SIZE;
+    errNum |= clEnqueueNDRangeKernel(commandQueue, s->count, 1, NULL, &globalWorkSize, &localWorkSize, 0, NULL, rs_event(s, RS_STAGE_HISTOGRAM, -1));
+    if(!errNum == CL_SUCCESS){
+        printf("Count keys kernel terminated abruptly\n");
+        exit(1);
+    }
+    errNum = clEnqueueReadBuffer(commandQueue, s->distinct_counts_buffer, CL_TRUE, 0, sizeof(int) * (nvalues + 1), s->distinctCounts, 0, NULL, NULL);
+    if(s->distinctCounts[nvalues])
+        return 0;
+
+    //Write the runs (checked on the host, as nothing sorted is on the device)
+    if(s->flags & RS_VERIFY)
+        rs_native_check(s->keyType, array, NULL, size, s->check, 0);
+    unsigned char *out = (unsigned char*)output;
+    for(i = 0; i < nvalues; i++) {
+        int count = s->distinctCounts[i], k;
+        if(keySize == 4) {
+            uint32_t key;
+            memcpy(&key, s->distinctKeys + 4 * (size_t)i, 4);
+            for(k = 0; k < count; k++)
+                ((uint32_t*)out)[k] = key;
+        }
+        else {
+            uint64_t key;
+            memcpy(&key, s->distinctKeys + 8 * (size_t)i, 8);
+            for(k = 0; k < count; k++)
+                ((uint64_t*)out)[k] = key;
+        }
+        out += (size_t)keySize * count;
+    }
+    if(s->flags & RS_VERIFY)
+        rs_native_check(s->keyType, output, NULL, size, s->check, 1);
+    return 1;
+}
+
+
+//**********************************************
+// rs_sort
+//
+//   Sorts the keys in array into output (if not
+//   NULL) carrying along the values, which may
+//   be 32/64-bit words (valueWords 1/2), the
+//   key indices (INDEX_VALUES) or none (0).
+//   Zero-copy sessions sort in those arrays,
+//   the others copy them to the device and back
+//**********************************************
+static void rs_sort(rs_session *s, void *array, void *output, void *values, void *values_output, int valueWords, int size) {
+
+    //----------------------
+    // Initialize host data
+    //----------------------
+    size_t array_dataSize = (size_t)s->keySize*size;
+    size_t value_dataSize = (size_t)sizeof(cl_uint)*(valueWords == INDEX_VALUES ? 1 : valueWords)*size;
+
+    cl_int errNum;
+
+    //Nothing to sort (and nothing out of order)
+    memset(s->check, 0, sizeof(s->check));
+    if(size < 2) {
+        if(output && output != array)
+            memcpy(output, array, array_dataSize);
+        if(valueWords == INDEX_VALUES && size == 1)
+            ((cl_uint*)values_output)[0] = 0;
+        else if(valueWords > 0)
+            memmove(values_output, values, value_dataSize);
+        return;
+    }
+
+    //Native sessions sort on host threads (and check on the host too), and
+    //so do the others past the look-back limit (the counts take 30 bits)
+    if(s->native || size > LOOKBACK_MAX_KEYS) {
+        s->nprof = 0;
+        s->lastSize = size;
+        if(s->flags & RS_VERIFY)
+            rs_native_check(s->keyType, array, NULL, size, s->check, 0);
+        rs_native_sort(s->keyType, s->radix, array, output, values, values_output, valueWords, size, &s->nativeWorkspace);
+        if(s->flags & RS_VERIFY)
+            rs_native_check(s->keyType, output ? output : array, output ? NULL : (int*)values_output, size, s->check, 1);
+        return;
+    }
+
+    //Scale the number of histogram groups with the input
+    int n_groups = rs_groups(s, size);
+    //Reorder tiles: one per group
+    int tileSize = WG_SIZE * TILE_KEYS;
+    int ntiles = (size + tileSize - 1) / tileSize;
+
+    //----------------------------
+    // Grow buffers (if necessary)
+    //----------------------------
+    rs_reserve(s, array_dataSize);
+    if(valueWords != 0 && value_dataSize > s->valueCapacity) {
+        if(s->value_buffer)
+            clReleaseMemObject(s->value_buffer);
+        if(s->value_output_buffer)
+            clReleaseMemObject(s->value_output_buffer);
+
+        //Create payload buffs
+        cl_mem_flags scratch = CL_MEM_READ_WRITE | (s->zeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0);
+        s->value_buffer = clCreateBuffer(s->context, scratch, value_dataSize, NULL, &errNum);
+        s->value_output_buffer = clCreateBuffer(s->context, scratch, value_dataSize, NULL, &errNum);
+        if(!errNum == CL_SUCCESS){
+            printf("Error creating the value buffers\n");
+            exit(1);
+        }
+        s->valueCapacity = value_dataSize;
+    }
+    if(ntiles > s->stateTiles) {
+        if(s->state_buffer)
+            clReleaseMemObject(s->state_buffer);
+
+        //Create look-back state buff: the tickets, then two regions of a word
+        //per tile per digit (zeroed: nothing published)
+        size_t stateSize = sizeof(int) * (1 + 2 * (size_t)ntiles * s->buckets);
+        int *state = (int*)calloc(1, stateSize);
+        s->state_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, stateSize, state, &errNum);
+        free(state);
+        if(!errNum == CL_SUCCESS){
+            printf("Error creating the look-back state buffer\n");
+            exit(1);
+        }
+        s->stateTiles = ntiles;
+        s->stateRegion = 0;
+        s->stateDirty[0] = s->stateDirty[1] = 0;
+        s->stateTickets = 0;
+    }
+    cl_command_queue commandQueue = s->commandQueue;
+    s->nprof = 0;
+    s->lastSize = size;
+    s->lastValueSize = valueWords ? value_dataSize / size : 0;
+    //Buffers the passes read first (array_buffer, value_buffer) and the
+    //ones they must leave the result on (NULL: any, it is read back)
+    cl_mem array_buffer = s->array_buffer;
+    cl_mem value_buffer = valueWords > 0 ? s->value_buffer : NULL;
+    cl_mem array_target = NULL, value_target = NULL;
+    //Zero-copy buffers of the caller's arrays, released after the sort
+    cl_mem wrapped[4] = {NULL, NULL, NULL, NULL};
+
+
+    //----------------------
+    // Enqueue device write (host -> device buffer)
+    //----------------------
+
+    if(s->zeroCopy) {
+        //Wrap the caller's arrays instead (the input is only read unless
+        //the sort is in place)
+        array_buffer = wrapped[0] = rs_wrap(s, array, array_dataSize, output == array ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY);
+        if(output)
+            array_target = output == array ? array_buffer : (wrapped[1] = rs_wrap(s, output, array_dataSize, CL_MEM_READ_WRITE));
+        if(valueWords > 0)
+            value_buffer = wrapped[2] = rs_wrap(s, values, value_dataSize, values_output == values ? CL_MEM_READ_WRITE : CL_MEM_READ_ONLY);
+        if(valueWords != 0)
+            value_target = values_output == values ? value_buffer : (wrapped[3] = rs_wrap(s, values_output, value_dataSize, CL_MEM_READ_WRITE));
+    }
+    else {
+        errNum = clEnqueueWriteBuffer(commandQueue, array_buffer, CL_FALSE, 0, array_dataSize, array, 0, NULL, rs_event(s, RS_STAGE_WRITE, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Array buffer write terminated abruptly\n");
+            exit(1);
+        }
+        if(valueWords > 0) {
+            errNum = clEnqueueWriteBuffer(commandQueue, value_buffer, CL_FALSE, 0, value_dataSize, values, 0, NULL, rs_event(s, RS_STAGE_WRITE, -1));
+            if(!errNum == CL_SUCCESS){
+                printf("Value buffer write terminated abruptly\n");
+                exit(1);
+            }
+        }
+    }
+
+    //---------------------------------------------
+    // Few distinct keys: one count, then the runs
+    //---------------------------------------------
+
+    if(valueWords == 0 && output && size >= DISTINCT_MIN_KEYS && rs_sort_distinct(s, array_buffer, array, output, n_groups, size)) {
+        int w;
+        for(w = 0; w < 4; w++)
+            if(wrapped[w])
+                clReleaseMemObject(wrapped[w]);
+        if(s->flags & RS_PROFILE)
+            rs_collect(s);
+        return;
+    }
+
+    //------------------------------------------------
+    // MSD: top digit down, buckets in local memory
+    //------------------------------------------------
+
+    if((s->flags & RS_MSD) && valueWords == 0 && output) {
+        rs_sort_msd(s, array_buffer, array_target, output, size);
+        if(s->zeroCopy)
+            clFinish(commandQueue);
+        int w;
+        for(w = 0; w < 4; w++)
+            if(wrapped[w])
+                clReleaseMemObject(wrapped[w]);
+        if(s->flags & RS_PROFILE)
+            rs_collect(s);
+        return;
+    }
+
+    //-------------------------------------------
+    // Histogram every digit in one read of keys
+    //-------------------------------------------
+
+    if(s->flags & RS_VERIFY)
+        errNum = clEnqueueWriteBuffer(commandQueue, s->check_buffer, CL_FALSE, 0, sizeof(s->check), s->check, 0, NULL, NULL);
+    rs_count_digits(s, array_buffer, 0, size, 0, s->passes - 1, s->flags & RS_VERIFY);
+    int pass;
+
+    //Passes where every key falls in one bucket are skipped (no kernels,
+    //no swap), the keys are encoded on the first pass run and decoded on
+    //the last. The counts of the others become digit starts
+    int firstPass = -1, lastPass = -1, remaining = 0;
+    char skip[sizeof(cl_ulong) * 8];
+    for(pass = 0; pass < s->passes; pass++) {
+        int *counts = s->digits + pass * s->buckets;
+        int d, start = 0;
+        skip[pass] = 0;
+        for(d = 0; d < s->buckets; d++) {
+            int count = counts[d];
+            if(count == size)
+                skip[pass] = 1;
+            counts[d] = start;
+            start += count;
+        }
+        if(!skip[pass]) {
+            if(firstPass < 0)
+                firstPass = pass;
+            lastPass = pass;
+            remaining++;
+        }
+    }
+    errNum = clEnqueueWriteBuffer(commandQueue, s->digits_buffer, CL_FALSE, 0, sizeof(int) * s->passes * s->buckets, s->digits, 0, NULL, NULL);
+
+
+    //-------------------------------
+    // Enqueue kernels for execution
+    //-------------------------------
+
+#ifdef DEBUG //Do only DEBUG passes
+    for(pass = 0; pass < DEBUG; pass++){
+#else        //Operate normaly
+    for(pass = 0; pass < s->passes; pass++){
+#endif
+        if(skip[pass]) {
+#ifdef PRINT
+            printf("Skipping pass:[%d]\n",pass);
+#endif
+            continue;
+        }
+        int passFlags = (pass == firstPass ? PASS_FIRST : 0) | (pass == lastPass ? PASS_LAST : 0);
+#ifdef PRINT
+        printf("Currently on pass:[%d]\n",pass);
+#endif
+
+        //Reorder arguments
+        cl_mem output_buffer = rs_destination(array_buffer, array_target, s->array_buffer, s->output_buffer, remaining);
+        cl_mem value_output_buffer = valueWords ? rs_destination(value_buffer, value_target, s->value_buffer, s->value_output_buffer, remaining) : NULL;
+        remaining--;
+        //Payload (the indices are generated on the first pass, then moved as words)
+        int passWords = (valueWords == INDEX_VALUES && pass != firstPass) ? 1 : valueWords;
+        rs_reorder(s, pass, array_buffer, output_buffer, value_buffer, value_output_buffer, passWords, passFlags, size, 0);
+
+
+        //The next pass reads what this one wrote
+        array_buffer = output_buffer;
+        value_buffer = value_output_buffer;
+
+    }
+
+    //-----------------------------------------
+    // Verify the sorted keys (still on device)
+    //-----------------------------------------
+
+    //One more read of the keys, over the histogram grid; only the result
+    //words come back, along with the sorted data
+    if(s->flags & RS_VERIFY)
+        rs_enqueue_verify(s, array_buffer, size, NULL, 0);
+
+    //-------------------
+    // Enqueue host read (device buffer -> host)
+    //-------------------
+
+    //The newest data is on array_buffer (and value_buffer).
+    //The queue is in-order, so the blocking read is the only synchronization
+    //point of the sort: the write and every kernel run back to back.
+    if(valueWords == INDEX_VALUES && firstPass < 0) {
+        //Every key is equal and no pass ran: identity permutation
+        int i;
+        for(i = 0; i < size; i++)
+            ((cl_uint*)values_output)[i] = i;
+    }
+    else if(valueWords != 0 && s->zeroCopy)
+        rs_unwrap(s, value_buffer, value_target, value_dataSize);
+    else if(valueWords != 0)
+        errNum = clEnqueueReadBuffer(commandQueue, value_buffer, output ? CL_FALSE : CL_TRUE, 0, value_dataSize, values_output, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+    if(output && s->zeroCopy)
+        rs_unwrap(s, array_buffer, array_target, array_dataSize);
+    else if(output)
+        errNum = clEnqueueReadBuffer(commandQueue, array_buffer, CL_TRUE, 0, array_dataSize, output, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+    //Argsorts of equal keys read nothing back, and the caller's arrays are
+    //left alone once the unmaps are done
+    if(s->zeroCopy || (s->flags & RS_VERIFY))
+        clFinish(commandQueue);
+
+    int w;
+    for(w = 0; w < 4; w++)
+        if(wrapped[w])
+            clReleaseMemObject(wrapped[w]);
+
+    if(s->flags & RS_PROFILE)
+        rs_collect(s);
+    
+    
+#ifdef DEBUG
+    int k;
+    printf("Arreglo Original:\n");
+    for(k=0; k<ARRLEN; k++) {
+        printf("[%d]", ((int*)array)[k]);
+    }
+    printf("\n\n");
+    printf("Inicio de los Digitos:");
+    for(k=0; k<s->passes*s->buckets; k++) {
+        printf("[%d]", s->digits[k]);
+    }
+    printf("\n\n");
+    printf("Resultado Ordenado:");
+    for(k=0; k<ARRLEN; k++) {
+        printf("[%d]", ((int*)output)[k]);
+    }
+    printf("\n\n");
+#endif
+}
+
+
+//**********************************************
+// rs_session_verify
+//
+//   Returns how many keys of the last sort are
+//   smaller than the one before them (0 when
+//   sorted), and sets *sameKeys (if not NULL) to
+//   whether the checksum of the output matches
+//   the one of the input. Needs RS_VERIFY
+//**********************************************
+int rs_session_verify(rs_session *s, int *sameKeys) {
+    if(!(s->flags & RS_VERIFY)) {
+        printf("Session created without RS_VERIFY\n");
+        exit(1);
+    }
+    if(sameKeys)
+        *sameKeys = s->check[CHECK_SUM_IN] == s->check[CHECK_SUM_OUT] && s->check[CHECK_XOR_IN] == s->check[CHECK_XOR_OUT];
+    return (int)s->check[CHECK_INVERSIONS];
+}
+
+
+//**********************************************
+// rs_session_sort
+//
+//   Takes an array of the session key type and
+//   its size and returns a sorted array,
+//   reusing the session
+//**********************************************
+void *rs_session_sort(rs_session *s, const void *array, int size) {
+    void *output = malloc((size_t)s->keySize*size);
+    rs_sort(s, (void*)array, output, NULL, NULL, 0, size);
+    return output;
+}
+
+
+//**********************************************
+// rs_session_sort_into
+//
+//   Sorts array into output, which the caller
+//   provides (size keys of the session type).
+//   Once the session buffers have grown to the
+//   size, it allocates nothing
+//**********************************************
+void rs_session_sort_into(rs_session *s, const void *array, void *output, int size) {
+    rs_sort(s, (void*)array, output, NULL, NULL, 0, size);
+}
+
+
+//**********************************************
+// rs_session_sort_inplace
+//
+//   Sorts an array of the session key type in
+//   place (zero-copy sessions sort it right in
+//   the caller's memory)
+//**********************************************
+void rs_session_sort_inplace(rs_session *s, void *array, int size) {
+    rs_sort(s, array, array, NULL, NULL, 0, size);
+}
+
+
+//**********************************************
+// rs_session_sort_pairs
+//
+//   Sorts keys and their values (valueSize bytes
+//   each) by key, in place
+//**********************************************
+void rs_session_sort_pairs(rs_session *s, void *keys, void *values, int valueSize, int size) {
+    if(valueSize != 4 && valueSize != 8) {
+        printf("Unsupported value size: %d\n", valueSize);
+        exit(1);
+    }
+    rs_sort(s, keys, keys, values, values, valueSize / sizeof(cl_uint), size);
+}
+
+
+//**********************************************
+// rs_session_argsort
+//
+//   Returns the stable permutation that sorts
+//   keys (keys[perm[0]] is the smallest)
+//**********************************************
+int *rs_session_argsort(rs_session *s, const void *keys, int size) {
+    int *perm = (int*)malloc(sizeof(int)*size);
+    rs_sort(s, (void*)keys, NULL, NULL, perm, INDEX_VALUES, size);
+    return perm;
+}
+
+
+//**********************************************
+// rs_session_argsort_into
+//
+//   Writes the stable permutation that sorts
+//   keys into perm, which the caller provides
+//**********************************************
+void rs_session_argsort_into(rs_session *s, const void *keys, int *perm, int size) {
+    rs_sort(s, (void*)keys, NULL, NULL, perm, INDEX_VALUES, size);
+}
+
+
+//**********************************************
+// rs_session_sort_segments
+//
+//   Sorts each segment of array (segment i from
+//   offsets[i] to offsets[i + 1]) in place. The
+//   segments that fit in local memory are sorted
+//   in one launch, a group each; larger ones get
+//   a sort of their own. RS_VERIFY checks the
+//   batch, each segment on its own order
+//**********************************************
+void rs_session_sort_segments(rs_session *s, void *array, const int *offsets, int nsegments) {
+
+    cl_int errNum;
+    int i, nsmall = 0;
+    if(nsegments <= 0)
+        return;
+    int size = offsets[nsegments] - offsets[0];
+    size_t array_dataSize = (size_t)s->keySize * offsets[nsegments];
+    int verify = s->flags & RS_VERIFY;
+
+    //Checks of the segments sorted on their own, added up
+    cl_uint check[CHECK_WORDS];
+    memset(check, 0, sizeof(check));
+
+    //Native sessions sort each one on its own
+    if(s->native) {
+        for(i = 0; i < nsegments; i++) {
+            rs_session_sort_inplace(s, (char*)array + (size_t)s->keySize * offsets[i], offsets[i + 1] - offsets[i]);
+            rs_add_check(check, s->check);
+        }
+        memcpy(s->check, check, sizeof(check));
+        return;
+    }
+
+    //Large segments first, so the session profile ends on the batch (and
+    //before the list is taken: MSD sorts use the segment buffers too)
+    for(i = 0; i < nsegments; i++) {
+        int keys = offsets[i + 1] - offsets[i];
+        if(keys > s->segmentKeys) {
+            rs_session_sort_inplace(s, (char*)array + (size_t)s->keySize * offsets[i], keys);
+            rs_add_check(check, s->check);
+        }
+    }
+
+    //Segment bounds and list of the launch (after its ticket)
+    rs_reserve_segments(s, nsegments + 1);
+    int *small = s->segmentList + 1;
+    s->segmentList[0] = 0;
+    for(i = 0; i < nsegments; i++) {
+        int keys = offsets[i + 1] - offsets[i];
+        if(keys > 1 && keys <= s->segmentKeys)
+            small[nsmall++] = i;
+    }
+    if(nsmall == 0) {
+        memcpy(s->check, check, sizeof(check));
+        return;
+    }
+    cl_command_queue commandQueue = s->commandQueue;
+    s->nprof = 0;
+    s->lastSize = size;
+    s->lastValueSize = 0;
+    memset(s->check, 0, sizeof(s->check));
+    if(verify)
+        errNum = clEnqueueWriteBuffer(commandQueue, s->check_buffer, CL_FALSE, 0, sizeof(s->check), s->check, 0, NULL, NULL);
+
+    errNum = clEnqueueWriteBuffer(commandQueue, s->segment_offsets_buffer, CL_FALSE, 0, sizeof(int) * (nsegments + 1), offsets, 0, NULL, NULL);
+    errNum |= clEnqueueWriteBuffer(commandQueue, s->segment_list_buffer, CL_FALSE, 0, sizeof(int) * (nsmall + 1), s->segmentList, 0, NULL, NULL);
+    if(!errNum == CL_SUCCESS){
+        printf("Segment buffers write terminated abruptly\n");
+        exit(1);
+    }
+
+    //-------------------------------------
+    // Sort the segments in the keys buffer
+    //-------------------------------------
+
+    //Zero-copy sessions sort the caller's array where it is, the others
+    //on the session's keys buffer (grown if necessary)
+    cl_mem array_buffer;
+    if(s->zeroCopy)
+        array_buffer = rs_wrap(s, array, array_dataSize, CL_MEM_READ_WRITE);
+    else {
+        rs_reserve(s, array_dataSize);
+        array_buffer = s->array_buffer;
+        errNum = clEnqueueWriteBuffer(commandQueue, array_buffer, CL_FALSE, 0, array_dataSize, array, 0, NULL, rs_event(s, RS_STAGE_WRITE, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Array buffer write terminated abruptly\n");
+            exit(1);
+        }
+    }
+
+    //The input checksum is added on one histogram read of the batch (the
+    //large segments are already sorted: they go in as they come out)
+    if(verify)
+        rs_count_digits(s, array_buffer, 0, offsets[nsegments], 0, 0, 1);
+
+    rs_enqueue_segments(s, array_buffer, array_buffer, nsmall);
+
+    //The verify takes the bounds of every segment, the large ones too: a key
+    //is only compared with the one before it in its segment
+    if(verify)
+        rs_enqueue_verify(s, array_buffer, offsets[nsegments], s->segment_offsets_buffer, nsegments + 1);
+
+    if(s->zeroCopy) {
+        rs_unwrap(s, array_buffer, array_buffer, array_dataSize);
+        clFinish(commandQueue);
+        clReleaseMemObject(array_buffer);
+    }
+    else
+        errNum = clEnqueueReadBuffer(commandQueue, array_buffer, CL_TRUE, 0, array_dataSize, array, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+
+    //The batch counts the inversions of every segment already, the sorts of
+    //the large ones only add their checksums
+    if(verify) {
+        check[CHECK_INVERSIONS] = 0;
+        rs_add_check(s->check, check);
+    }
+
+    if(s->flags & RS_PROFILE)
+        rs_collect(s);
+}
+
+
+//Key of keyType with the order-preserving bits (inverse of rs_key_bits)
+static void rs_key_from_bits(uint64_t bits, int keyType, void *key) {
+    uint32_t u32 = (uint32_t)bits;
+    switch(keyType) {
+        case RS_UINT32:
+            break;
+        case RS_INT32:
+            u32 ^= 0x80000000u;
+            break;
+        case RS_FLOAT:
+            u32 ^= (u32 & 0x80000000u) ? 0x80000000u : 0xffffffffu;
+            break;
+        case RS_INT64:
+            bits ^= 0x8000000000000000ULL;
+            break;
+        case RS_DOUBLE:
+            bits ^= (bits & 0x8000000000000000ULL) ? 0x8000000000000000ULL : ~0ULL;
+            break;
+    }
+    if(KEY_SIZE(keyType) == 4)
+        memcpy(key, &u32, 4);
+    else
+        memcpy(key, &bits, 8);
+}
+
+//Sets a key-typed kernel argument (32 or 64-bit) to bits
+static void rs_set_key_arg(rs_session *s, cl_kernel kernel, int index, uint64_t bits) {
+    cl_uint bits32 = (cl_uint)bits;
+    cl_ulong bits64 = bits;
+    clSetKernelArg(kernel, index, s->keySize, s->keySize == 8 ? (void*)&bits64 : (void*)&bits32);
+}
+
+
+//**********************************************
+// rs_select
+//
+//   Order-preserving bits of the key of rank
+//   rank (from 0) of the size keys of array.
+//   When gathered is not NULL, also copies the
+//   keys below it (or above it, with above)
+//   there, and returns how many. Each round
+//   counts one digit, from the top, of the keys
+//   still in the running and keeps those of the
+//   digit holding the rank. When a round keeps
+//   at most half of the keys it read, the next
+//   one moves them to output_buffer, so the
+//   rounds after it read only those
+//**********************************************
+static int rs_select(rs_session *s, const void *array, int size, int rank, int above, void *gathered, uint64_t *bits) {
+
+    s->nprof = 0;
+    s->lastSize = size;
+    s->lastValueSize = 0;
+    //On the host for native sessions and past the look-back limit, like rs_sort
+    if(s->native || size > LOOKBACK_MAX_KEYS) {
+        *bits = rs_native_select(s->keyType, s->radix, array, size, rank, &s->nativeWorkspace);
+        return gathered ? rs_native_gather(s->keyType, array, size, *bits, above, gathered) : 0;
+    }
+
+    cl_int errNum;
+    cl_command_queue commandQueue = s->commandQueue;
+    size_t array_dataSize = (size_t)s->keySize * size;
+    size_t localWorkSize = WG_SIZE;
+    size_t globalWorkSize = (size_t)rs_groups(s, size) * WG_SIZE;
+
+    //The keys stay on array_buffer (or the caller's array) for the gather,
+    //the ones kept go to either half of output_buffer
+    rs_reserve(s, array_dataSize);
+    cl_mem array_buffer = s->array_buffer, wrapped = NULL;
+    if(s->zeroCopy)
+        array_buffer = wrapped = rs_wrap(s, (void*)array, array_dataSize, CL_MEM_READ_ONLY);
+    else {
+        errNum = clEnqueueWriteBuffer(commandQueue, array_buffer, CL_FALSE, 0, array_dataSize, array, 0, NULL, rs_event(s, RS_STAGE_WRITE, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Array buffer write terminated abruptly\n");
+            exit(1);
+        }
+    }
+
+    //--------------------------------
+    // Narrow down one digit a round
+    //--------------------------------
+    uint64_t all = s->keySize == 8 ? ~0ULL : 0xffffffffULL;
+    uint64_t prefix = 0, mask = 0;
+    cl_mem input = array_buffer;
+    int inputOffset = 0, outputOffset = 0, nkeys = size, compact = 0, pass;
+    for(pass = s->passes - 1; pass >= 0; pass--) {
+        int shift = pass * s->radix;
+        memset(s->digits, 0, sizeof(int) * (s->buckets + 1));
+        errNum = clEnqueueWriteBuffer(commandQueue, s->digits_buffer, CL_FALSE, 0, sizeof(int) * (s->buckets + 1), s->digits, 0, NULL, NULL);
+        errNum |= clSetKernelArg(s->select, 0, sizeof(cl_mem), &input);             // Keys in the running
+        errNum |= clSetKernelArg(s->select, 1, sizeof(int), &inputOffset);
+        errNum |= clSetKernelArg(s->select, 2, sizeof(int), &nkeys);
+        errNum |= clSetKernelArg(s->select, 3, sizeof(cl_mem), &s->output_buffer);  // Keys kept
+        errNum |= clSetKernelArg(s->select, 4, sizeof(int), &outputOffset);
+        rs_set_key_arg(s, s->select, 7, prefix);
+        rs_set_key_arg(s, s->select, 8, mask);
+        errNum |= clSetKernelArg(s->select, 9, sizeof(int), &shift);
+        errNum |= clSetKernelArg(s->select, 10, sizeof(int), &compact);
+        errNum |= clEnqueueNDRangeKernel(commandQueue, s->select, 1, NULL, &globalWorkSize, &localWorkSize, 0, NULL, rs_event(s, RS_STAGE_HISTOGRAM, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Select kernel terminated abruptly\n");
+            exit(1);
+        }
+        errNum = clEnqueueReadBuffer(commandQueue, s->digits_buffer, CL_TRUE, 0, sizeof(int) * (s->buckets + 1), s->digits, 0, NULL, NULL);
+        if(compact) {
+            input = s->output_buffer;
+            inputOffset = outputOffset;
+            nkeys = s->digits[s->buckets];
+            //The next keys kept (half of these at most) go to the other half
+            outputOffset = outputOffset ? 0 : (size + 1) / 2;
+        }
+
+        //Digit holding the rank
+        int d = 0;
+        while(rank >= s->digits[d])
+            rank -= s->digits[d++];
+        prefix |= (uint64_t)d << shift;
+        mask |= ((uint64_t)(s->buckets - 1) << shift) & all;
+        compact = s->digits[d] <= nkeys / 2;
+    }
+    *bits = prefix;
+
+    //--------------------------------------
+    // Gather the keys below (or above) it
+    //--------------------------------------
+    int count = 0;
+    if(gathered) {
+        s->digits[0] = 0;
+        errNum = clEnqueueWriteBuffer(commandQueue, s->digits_buffer, CL_FALSE, 0, sizeof(int), s->digits, 0, NULL, NULL);
+        errNum |= clSetKernelArg(s->gather, 0, sizeof(cl_mem), &array_buffer);   // Input array
+        errNum |= clSetKernelArg(s->gather, 1, sizeof(int), &size);
+        errNum |= clSetKernelArg(s->gather, 2, sizeof(cl_mem), &s->output_buffer);
+        rs_set_key_arg(s, s->gather, 4, prefix);
+        errNum |= clSetKernelArg(s->gather, 5, sizeof(int), &above);
+        errNum |= clEnqueueNDRangeKernel(commandQueue, s->gather, 1, NULL, &globalWorkSize, &localWorkSize, 0, NULL, rs_event(s, RS_STAGE_HISTOGRAM, -1));
+        if(!errNum == CL_SUCCESS){
+            printf("Gather kernel terminated abruptly\n");
+            exit(1);
+        }
+        errNum = clEnqueueReadBuffer(commandQueue, s->digits_buffer, CL_TRUE, 0, sizeof(int), s->digits, 0, NULL, NULL);
+        count = s->digits[0];
+        if(count > 0)
+            errNum = clEnqueueReadBuffer(commandQueue, s->output_buffer, CL_TRUE, 0, (size_t)s->keySize * count, gathered, 0, NULL, rs_event(s, RS_STAGE_READ, -1));
+    }
+    if(wrapped)
+        clReleaseMemObject(wrapped);
+    if(s->flags & RS_PROFILE)
+        rs_collect(s);
+    return count;
+}
+
+//Writes count copies of the key with the order-preserving bits to output
+static void rs_fill_key(rs_session *s, void *output, int count, uint64_t bits) {
+    unsigned char key[sizeof(cl_ulong)];
+    rs_key_from_bits(bits, s->keyType, key);
+    int i;
+    for(i = 0; i < count; i++)
+        memcpy((unsigned char*)output + (size_t)s->keySize * i, key, s->keySize);
+}
+
+
+//**********************************************
+// rs_session_nth_element
+//
+//   Writes to nth the key that sorting array
+//   would leave at position n, found in a few
+//   counts of the keys instead of a sort
+//**********************************************
+void rs_session_nth_element(rs_session *s, const void *array, int size, int n, void *nth) {
+    if(n < 0 || n >= size) {
+        printf("Position %d out of %d keys\n", n, size);
+        exit(1);
+    }
+    uint64_t bits;
+    rs_select(s, array, size, n, 0, NULL, &bits);
+    rs_key_from_bits(bits, s->keyType, nth);
+}
+
+
+//**********************************************
+// rs_session_partial_sort
+//
+//   Writes the k smallest keys of array to
+//   output, in order: the k-th is selected,
+//   the keys below it gathered and sorted, and
+//   the rest of output filled with it
+//**********************************************
+void rs_session_partial_sort(rs_session *s, const void *array, void *output, int size, int k) {
+    if(k < 0 || k > size) {
+        printf("Cannot take %d of %d keys\n", k, size);
+        exit(1);
+    }
+    if(k == 0)
+        return;
+    uint64_t bits;
+    int below = rs_select(s, array, size, k - 1, 0, output, &bits);
+    rs_session_sort_inplace(s, output, below);
+    rs_fill_key(s, (unsigned char*)output + (size_t)s->keySize * below, k - below, bits);
+}
+
+
+//**********************************************
+// rs_session_top_k
+//
+//   Writes the k largest keys of array to
+//   output, largest first
+//**********************************************
+void rs_session_top_k(rs_session *s, const void *array, void *output, int size, int k) {
+    if(k < 0 || k > size) {
+        printf("Cannot take %d of %d keys\n", k, size);
+        exit(1);
+    }
+    if(k == 0)
+        return;
+    uint64_t bits;
+    int above = rs_select(s, array, size, size - k, 1, output, &bits);
+    rs_session_sort_inplace(s, output, above);
+
+    //Largest first, then the copies of the k-th largest
+    unsigned char *keys = (unsigned char*)output, tmp[sizeof(cl_ulong)];
+    int i, keySize = s->keySize;
+    for(i = 0; i < above / 2; i++) {
+        memcpy(tmp, keys + (size_t)keySize * i, keySize);
+        memcpy(keys + (size_t)keySize * i, keys + (size_t)keySize * (above - 1 - i), keySize);
+        memcpy(keys + (size_t)keySize * (above - 1 - i), tmp, keySize);
+    }
+    rs_fill_key(s, keys + (size_t)keySize * above, k - above, bits);
+}
+
+
+//**********************************************
+// radixsort
+//
+//   Takes an int array pointer an its size and
+//   returns a sorted array (one-shot session)
+//**********************************************
+int *radixsort(int *array, int size) {
+    rs_session *s = rs_session_create(RS_INT32, 0);
+    int *output = rs_session_sort(s, array, size);
+    rs_session_destroy(s);
+    return output;
+}
+
+
+//**********************************************
+// rs_key_bits
+//
+//   Order-preserving unsigned bits of a key of
+//   keyType (what encode makes of it)
+//**********************************************
+uint64_t rs_key_bits(const void *key, int keyType) {
+    uint32_t u32;
+    uint64_t u64;
+    switch(keyType) {
+        case RS_UINT32:
+            memcpy(&u32, key, 4);
+            return u32;
+        case RS_INT32:
+            memcpy(&u32, key, 4);
+            return u32 ^ 0x80000000u;
+        case RS_FLOAT:
+            memcpy(&u32, key, 4);
+            return u32 ^ ((u32 & 0x80000000u) ? 0xffffffffu : 0x80000000u);
+        case RS_INT64:
+            memcpy(&u64, key, 8);
+            return u64 ^ 0x8000000000000000ULL;
+        case RS_DOUBLE:
+            memcpy(&u64, key, 8);
+            return u64 ^ ((u64 & 0x8000000000000000ULL) ? ~0ULL : 0x8000000000000000ULL);
+    }
+    memcpy(&u64, key, 8);
+    return u64;
 }
@@ -12,233 +12,841 @@
 
 #include "radixsort.h"
 
-/** COUNT KERNEL **/
+/** KEY TYPE **/
 
-__kernel void count(const __global int* input,
-                    __global int* output,
-                    __local int* local_histo,
-                    const int pass,
-                    const int nkeys)
+//Key type to sort, set by the host with -DKEY_TYPE=...
+#ifndef KEY_TYPE
+#define KEY_TYPE RS_INT32
+#endif
+
+//Keys are sorted as unsigned integers of the same size
+#if KEY_SIZE(KEY_TYPE) == 8
+typedef ulong rs_key;
+#else
+typedef uint rs_key;
+#endif
+
+//Number of total bits in the keys to sort
+#define BITS (KEY_SIZE(KEY_TYPE) * 8)
+
+//Passes of a sort (the last digit may be narrower)
+#define PASSES ((BITS + RADIX - 1) / RADIX)
+
+#define SIGN_BIT ((rs_key)1 << (BITS - 1))
+#define ALL_BITS (~(rs_key)0)
+
+//Order-preserving transform of the key bits (applied on the first pass run)
+rs_key encode(rs_key key)
+{
+#if KEY_TYPE == RS_INT32 || KEY_TYPE == RS_INT64
+    //Two's complement: negatives go below positives
+    return key ^ SIGN_BIT;
+#elif KEY_TYPE == RS_FLOAT || KEY_TYPE == RS_DOUBLE
+    //IEEE 754: flip every bit of negatives, only the sign of positives
+    return key ^ ((key & SIGN_BIT) ? ALL_BITS : SIGN_BIT);
+#else
+    return key;
+#endif
+}
+
+//Inverse of encode (applied on the last pass run)
+rs_key decode(rs_key key)
+{
+#if KEY_TYPE == RS_INT32 || KEY_TYPE == RS_INT64
+    return key ^ SIGN_BIT;
+#elif KEY_TYPE == RS_FLOAT || KEY_TYPE == RS_DOUBLE
+    return key ^ ((key & SIGN_BIT) ? SIGN_BIT : ALL_BITS);
+#else
+    return key;
+#endif
+}
+
+
+/** VECTOR LOADS **/
+
+//Keys per vector load, set by the host with -DVECTOR_KEYS=4 or 8
+#define CONCAT(a, b) CONCAT_(a, b)
+#define CONCAT_(a, b) a##b
+#define VLOAD_KEYS CONCAT(vload, VECTOR_KEYS)
+#define VSTORE_KEYS CONCAT(vstore, VECTOR_KEYS)
+
+//Loads VECTOR_KEYS consecutive keys with one vector load
+void load_keys(const __global rs_key* input, rs_key* keys)
 {
-    uint g_id = (uint) get_global_id(0);
+    VSTORE_KEYS(VLOAD_KEYS(0, input), 0, keys);
+}
+
+
+/** CHECKSUM **/
+
+//Set by the host with -DVERIFY=1 when the sorts are checked
+#ifndef VERIFY
+#define VERIFY 0
+#endif
+
+//Hash of the key bits (murmur3 finalizer), the checksum adds and xors them
+//so it doesn't depend on the order of the keys
+uint key_hash(rs_key key, uint seed)
+{
+    uint h = (uint)key ^ seed;
+#if KEY_SIZE(KEY_TYPE) == 8
+    h = (h ^ (h >> 16)) * 0x85ebca6bu ^ (uint)(key >> 32);
+#endif
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+
+/** HISTOGRAM KERNEL **/
+
+//Digit histograms of histogram_passes passes (from first_pass on, or less
+//on the last launch) in one read of the keys (nkeys from offset on), added
+//to output laid out [pass][bucket]. The host sets histogram_passes to as
+//many as local_histo fits in the local memory the kernel leaves. When
+//verifying, the launch given check (the first one over the input) also
+//adds the checksum of its keys to it
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void histogram(const __global rs_key* input,
+               __global int* output,
+               __local int* local_histo,
+               const int nkeys,
+               const int first_pass,
+               __global uint* check,
+               const int offset,
+               const int histogram_passes)
+{
+    input += offset;
     uint l_id = (uint) get_local_id(0);
-    uint l_size = (uint) get_local_size(0);    
 
     uint group_id = (uint) get_group_id(0);
     uint n_groups = (uint) get_num_groups(0); 
     
-    //Set the buckets of each item to 0
-    int i;
-    for(i = 0; i < BUCK; i++) {
-        local_histo[i * l_size + l_id] = 0;
+    //Set the buckets of the group to 0
+    int i, k, p;
+    for(i = l_id; i < histogram_passes * BUCK; i += WG_SIZE) {
+        local_histo[i] = 0;
     }
+#if VERIFY
+    __local uint local_check[2];
+    uint sum = 0, mix = 0;
+    if(l_id < 2)
+        local_check[l_id] = 0;
+#endif
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    //Calculate elements to process per item
-    int size = (nkeys / n_groups) / l_size;
-    //Calculate where to start on the global array
-    int start = g_id * size;
-    
-    for(i = 0; i < size; i++) {
-        int key = input[i + start];
-        //Extract the corresponding radix of the key
-        key = ((key >> (pass * RADIX)) & (BUCK - 1));
-        //Count the ocurrences in the corresponding bucket
-        local_histo[key * l_size + l_id]++;
+    //Each group counts a contiguous block of whole vectors (rounded up, the
+    //tail groups get less or none), its items load interleaved vectors so
+    //the loads of neighbouring items are neighbouring too
+    int size = (nkeys + n_groups - 1) / n_groups;
+    size = (size + VECTOR_KEYS - 1) / VECTOR_KEYS * VECTOR_KEYS;
+    //Calculate where to start and end on the global array
+    int start = min((int)group_id * size, nkeys);
+    int end = min(start + size, nkeys);
+    //Keys left over after the last whole vector
+    int vector_end = end - (end - start) % VECTOR_KEYS;
+
+    for(i = start + l_id * VECTOR_KEYS; i < vector_end; i += WG_SIZE * VECTOR_KEYS) {
+        rs_key keys[VECTOR_KEYS];
+        load_keys(input + i, keys);
+        for(k = 0; k < VECTOR_KEYS; k++) {
+#if VERIFY
+            sum += key_hash(keys[k], CHECK_SEED_SUM);
+            mix ^= key_hash(keys[k], CHECK_SEED_XOR);
+#endif
+            //The passes see the transformed keys
+            rs_key item = encode(keys[k]);
+            for(p = 0; p < histogram_passes && first_pass + p < PASSES; p++) {
+                //Extract the corresponding radix of the key
+                int key = (int)((item >> ((first_pass + p) * RADIX)) & (BUCK - 1));
+                //Count the ocurrences in the corresponding bucket
+                atomic_inc(&local_histo[p * BUCK + key]);
+            }
+        }
     }
+    for(i = vector_end + l_id; i < end; i += WG_SIZE) {
+#if VERIFY
+        sum += key_hash(input[i], CHECK_SEED_SUM);
+        mix ^= key_hash(input[i], CHECK_SEED_XOR);
+#endif
+        rs_key item = encode(input[i]);
+        for(p = 0; p < histogram_passes && first_pass + p < PASSES; p++)
+            atomic_inc(&local_histo[p * BUCK + (int)((item >> ((first_pass + p) * RADIX)) & (BUCK - 1))]);
+    }
+#if VERIFY
+    atomic_add(&local_check[0], sum);
+    atomic_xor(&local_check[1], mix);
+#endif
 
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    for(i = 0; i < BUCK; i++) {
-        //"from" references the local buckets
-        int from = i * l_size + l_id;
-        //"to" maps to the global buckets
-        int to = i * n_groups + group_id;
-        //Map the local data to its global position
-        output[l_size * to + l_id] = local_histo[from];
+#if VERIFY
+    if(l_id == 0 && check) {
+        atomic_add(&check[CHECK_SUM_IN], local_check[0]);
+        atomic_xor(&check[CHECK_XOR_IN], local_check[1]);
+    }
+#endif
+
+    int npasses = min(histogram_passes, PASSES - first_pass);
+    for(i = l_id; i < npasses * BUCK; i += WG_SIZE) {
+        if(local_histo[i])
+            atomic_add(&output[first_pass * BUCK + i], local_histo[i]);
     }
-    
-    barrier(CLK_GLOBAL_MEM_FENCE);
 }
 
-/** SCAN KERNEL **/
-__kernel void scan(__global int* input,
-                   __global int* output,
-                   __local int* local_scan,
-                   __global int* block_sum)
+
+/** DISTINCT KEYS KERNEL **/
+
+//Index of key in the nvalues ascending values of table, or -1
+int find_key(__local rs_key* table, int nvalues, rs_key key)
+{
+    int lo = 0, hi = nvalues;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(table[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < nvalues && table[lo] == key) ? lo : -1;
+}
+
+//Counts of the keys of each of the nvalues values of table (encoded, in
+//ascending order), added to counts. A key of any other value sets
+//counts[nvalues], and the host sorts the regular way instead
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void count_keys(const __global rs_key* input,
+                const int nkeys,
+                const __global rs_key* table,
+                const int nvalues,
+                __global int* counts,
+                __local rs_key* local_table,
+                __local int* local_counts)
 {
-    uint g_id = (uint) get_global_id(0);
     uint l_id = (uint) get_local_id(0);
-    uint l_size = (uint) get_local_size(0);    
 
     uint group_id = (uint) get_group_id(0);
-    uint n_groups = (uint) get_num_groups(0); 
+    uint n_groups = (uint) get_num_groups(0);
+
+    __local int local_missed;
+    int i, k, missed = 0;
+    for(i = l_id; i < nvalues; i += WG_SIZE) {
+        local_table[i] = table[i];
+        local_counts[i] = 0;
+    }
+    if(l_id == 0)
+        local_missed = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    //Same blocks and loads as the histogram
+    int size = (nkeys + n_groups - 1) / n_groups;
+    size = (size + VECTOR_KEYS - 1) / VECTOR_KEYS * VECTOR_KEYS;
+    int start = min((int)group_id * size, nkeys);
+    int end = min(start + size, nkeys);
+    int vector_end = end - (end - start) % VECTOR_KEYS;
+
+    for(i = start + l_id * VECTOR_KEYS; i < vector_end; i += WG_SIZE * VECTOR_KEYS) {
+        rs_key keys[VECTOR_KEYS];
+        load_keys(input + i, keys);
+        for(k = 0; k < VECTOR_KEYS; k++) {
+            int value = find_key(local_table, nvalues, encode(keys[k]));
+            if(value < 0)
+                missed = 1;
+            else
+                atomic_inc(&local_counts[value]);
+        }
+    }
+    for(i = vector_end + l_id; i < end; i += WG_SIZE) {
+        int value = find_key(local_table, nvalues, encode(input[i]));
+        if(value < 0)
+            missed = 1;
+        else
+            atomic_inc(&local_counts[value]);
+    }
+    if(missed)
+        local_missed = 1;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(i = l_id; i < nvalues; i += WG_SIZE) {
+        if(local_counts[i])
+            atomic_add(&counts[i], local_counts[i]);
+    }
+    if(l_id == 0 && local_missed)
+        counts[nvalues] = 1;
+}
+
 
-    //Store data from global to local memory to operate
-    local_scan[2 * l_id] = input[2 * g_id];
-    local_scan[2 * l_id + 1] = input[2 * g_id + 1];
+/** REORDER KERNELS **/
 
-    //UP SWEEP
-    int d, offset = 1;
-    for(d = l_size; d > 0; d >>= 1){
+//Exclusive scan of one value per item of the group, the total is left
+//on sums[WG_SIZE - 1]
+int group_scan(__local int* sums, int value)
+{
+    uint l_id = (uint) get_local_id(0);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    sums[l_id] = value;
+    uint d;
+    for(d = 1; d < WG_SIZE; d <<= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int add = (l_id >= d) ? sums[l_id - d] : 0;
         barrier(CLK_LOCAL_MEM_FENCE);
-        if(l_id < d) {
-            int a = offset * (2 * l_id + 1) - 1;
-            int b = offset * (2 * l_id + 2) - 1;
-            local_scan[b] += local_scan[a];
+        sums[l_id] += add;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return sums[l_id] - value;
+}
+
+//Each group reorders a tile of WG_SIZE * TILE_KEYS keys: the tile is loaded
+//with interleaved vector reads and sorted by the pass digit in local memory
+//(one stable split per digit bit). Where each digit run goes is the digit
+//start (from the upfront histogram) plus the keys of that digit in the tiles
+//before, which the group learns by looking back at their published counts
+//(decoupled look-back). The tile is written back with interleaved stores,
+//so each run goes to consecutive addresses
+void reorder_tile(__global rs_key* array,
+                  __global int* digits,
+                  __global rs_key* output,
+                  const int nkeys,
+                  __local int* local_digit,
+                  __global uint* values,
+                  __global uint* values_out,
+                  const int value_words,
+                  const int flags,
+                  __local rs_key* local_keys,
+                  __local int* local_index,
+                  __local int* local_sums,
+                  __local int* local_base,
+                  volatile __global int* state,
+                  const int region,
+                  const uint ticket_base,
+                  const int clear,
+                  const int nclear,
+                  const int pass)
+{
+    uint l_id = (uint) get_local_id(0);
+
+    uint group_id = (uint) get_group_id(0);
+    uint n_groups = (uint) get_num_groups(0); 
+
+    __local int tile_id;
+
+    //Clear the look-back state the next pass will use
+    int i, k, d;
+    for(i = group_id * WG_SIZE + l_id; i < nclear; i += n_groups * WG_SIZE)
+        state[clear + i] = 0;
+
+    //Tiles are numbered in the order the groups start (not by group id),
+    //so a tile only waits on tiles that are already running
+    if(l_id == 0)
+        tile_id = (int)((uint)atomic_inc(&state[0]) - ticket_base);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int tile = tile_id;
+
+    //local_keys and local_index hold two tiles, src and dst alternate
+    int tile_size = WG_SIZE * TILE_KEYS;
+    int start = tile * tile_size;
+    int tile_keys = min(tile_size, nkeys - start);
+    int vector_keys = tile_keys - tile_keys % VECTOR_KEYS;
+    int src = 0, dst = tile_size;
+
+    //Interleaved vector load of the tile (the last keys one by one)
+    for(i = l_id * VECTOR_KEYS; i < vector_keys; i += WG_SIZE * VECTOR_KEYS) {
+        rs_key keys[VECTOR_KEYS];
+        load_keys(array + start + i, keys);
+        for(k = 0; k < VECTOR_KEYS; k++) {
+            local_keys[i + k] = (flags & PASS_FIRST) ? encode(keys[k]) : keys[k];
+            local_index[i + k] = i + k;
         }
-        offset *= 2;
     }
-    
-    if (l_id == 0) {
-        //Store the full sum on last item
-        if(block_sum != NULL){
-            block_sum[group_id] = local_scan[l_size * 2 - 1];
+    for(i = vector_keys + l_id; i < tile_keys; i += WG_SIZE) {
+        rs_key item = array[start + i];
+        local_keys[i] = (flags & PASS_FIRST) ? encode(item) : item;
+        local_index[i] = i;
+    }
+
+    //Each item splits a contiguous run of the tile
+    int first = min((int)l_id * TILE_KEYS, tile_keys);
+    int last = min(first + TILE_KEYS, tile_keys);
+
+    //Stable split on each bit of the digit, zeros before ones
+    int bit;
+    for(bit = pass * RADIX; bit < (pass + 1) * RADIX && bit < BITS; bit++) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int zeros = 0;
+        for(k = 0; k < TILE_KEYS; k++)
+            if(first + k < last)
+                zeros += !((local_keys[src + first + k] >> bit) & 1);
+        int zero_pos = group_scan(local_sums, zeros);
+        int one_pos = local_sums[WG_SIZE - 1] + first - zero_pos;
+        for(k = 0; k < TILE_KEYS; k++) {
+            if(first + k < last) {
+                rs_key item = local_keys[src + first + k];
+                int pos = ((item >> bit) & 1) ? one_pos++ : zero_pos++;
+                local_keys[dst + pos] = item;
+                local_index[dst + pos] = local_index[src + first + k];
+            }
         }
+        int tmp = src;
+        src = dst;
+        dst = tmp;
+    }
 
-        //Clear the last element
-        local_scan[l_size * 2 - 1] = 0;
+    //Start of each digit in the sorted tile
+    for(d = l_id; d < BUCK; d += WG_SIZE)
+        local_digit[d] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for(i = l_id; i < tile_keys; i += WG_SIZE)
+        atomic_inc(&local_digit[(int)((local_keys[src + i] >> (pass * RADIX)) & (BUCK - 1))]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int digits_per_item = (BUCK + WG_SIZE - 1) / WG_SIZE;
+    int sum = 0;
+    for(d = l_id * digits_per_item; d < (l_id + 1) * digits_per_item && d < BUCK; d++)
+        sum += local_digit[d];
+    int offset = group_scan(local_sums, sum);
+    for(d = l_id * digits_per_item; d < (l_id + 1) * digits_per_item && d < BUCK; d++) {
+        int count = local_digit[d];
+        local_digit[d] = offset;
+        offset += count;
     }
 
-    //DOWN SWEEP
-    for(d = 1; d < (l_size*2); d *= 2) {
-        offset >>= 1;
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if(l_id < d) {
-            int a = offset * (2 * l_id + 1) - 1;
-            int b = offset * (2 * l_id + 2) - 1;
-            int tmp = local_scan[a];
-            local_scan[a] = local_scan[b];
-            local_scan[b] += tmp;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    //Publish the count of each digit in this tile, then look back until
+    //a tile with the count up to itself (tile 0 has it right away)
+    volatile __global int* tile_state = state + region + tile * BUCK;
+    for(d = l_id; d < BUCK; d += WG_SIZE) {
+        int count = ((d + 1 < BUCK) ? local_digit[d + 1] : tile_keys) - local_digit[d];
+        int prefix = 0;
+        if(tile > 0) {
+            atomic_xchg(&tile_state[d], LOOKBACK(count, LOOKBACK_AGGREGATE));
+            int t = tile - 1;
+            while(t >= 0) {
+                int status = atomic_add(&state[region + t * BUCK + d], 0);
+                //Not published yet
+                if(!(status & (LOOKBACK_AGGREGATE | LOOKBACK_PREFIX)))
+                    continue;
+                prefix += (int)((uint)status >> 2);
+                if(status & LOOKBACK_PREFIX)
+                    break;
+                t--;
+            }
         }
+        atomic_xchg(&tile_state[d], LOOKBACK(prefix + count, LOOKBACK_PREFIX));
+        local_base[d] = digits[pass * BUCK + d] + prefix;
     }
+
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    //Write results from Local to Global memory
-    output[2 * g_id]     = local_scan[2 * l_id];
-    output[2 * g_id + 1] = local_scan[2 * l_id + 1];
+    //Interleaved store: neighbouring items write neighbouring
+    //addresses of the same digit run
+    for(i = l_id; i < tile_keys; i += WG_SIZE) {
+        rs_key item = local_keys[src + i];
+        int key = (int)((item >> (pass * RADIX)) & (BUCK - 1));
+        int pos = local_base[key] + i - local_digit[key];
+
+        //Intermediate passes keep the transformed keys
+        output[pos] = (flags & PASS_LAST) ? decode(item) : item;
+
+        //Move the payload (if any) along with its key
+        int from = start + local_index[src + i];
+        if(value_words == INDEX_VALUES) {
+            values_out[pos] = from;
+        }
+        else {
+            int w;
+            for(w = 0; w < value_words; w++)
+                values_out[pos * value_words + w] = values[from * value_words + w];
+        }
+    }
 }
 
+//One reorder kernel per pass (reorder_0, reorder_1...), so the digit shifts
+//are constants of each one
+//The keys reordered are the nkeys from offset on (of array and output, the
+//values are not moved: MSD partitions have none)
+#define REORDER_KERNEL(p)                                                         \
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))                     \
+void reorder_##p(__global rs_key* array, __global int* digits,                    \
+                 __global rs_key* output, const int nkeys,                        \
+                 __local int* local_digit, __global uint* values,                 \
+                 __global uint* values_out, const int value_words,                \
+                 const int flags, __local rs_key* local_keys,                     \
+                 __local int* local_index, __local int* local_sums,               \
+                 __local int* local_base, volatile __global int* state,           \
+                 const int region, const uint ticket_base,                        \
+                 const int clear, const int nclear, const int offset)             \
+{                                                                                 \
+    reorder_tile(array + offset, digits, output + offset, nkeys, local_digit,     \
+                 values, values_out, value_words, flags, local_keys, local_index, \
+                 local_sums, local_base, state, region, ticket_base, clear,       \
+                 nclear, p);                                                      \
+}
 
-/** COALESCE KERNEL **/
-__kernel void coalesce(__global int* scan,
-                       __global int* block_sums)
+REORDER_KERNEL(0)
+#if PASSES > 1
+REORDER_KERNEL(1)
+#endif
+#if PASSES > 2
+REORDER_KERNEL(2)
+#endif
+#if PASSES > 3
+REORDER_KERNEL(3)
+#endif
+#if PASSES > 4
+REORDER_KERNEL(4)
+#endif
+#if PASSES > 5
+REORDER_KERNEL(5)
+#endif
+#if PASSES > 6
+REORDER_KERNEL(6)
+#endif
+#if PASSES > 7
+REORDER_KERNEL(7)
+#endif
+#if PASSES > 8
+REORDER_KERNEL(8)
+#endif
+#if PASSES > 9
+REORDER_KERNEL(9)
+#endif
+#if PASSES > 10
+REORDER_KERNEL(10)
+#endif
+#if PASSES > 11
+REORDER_KERNEL(11)
+#endif
+#if PASSES > 12
+REORDER_KERNEL(12)
+#endif
+#if PASSES > 13
+REORDER_KERNEL(13)
+#endif
+#if PASSES > 14
+REORDER_KERNEL(14)
+#endif
+#if PASSES > 15
+REORDER_KERNEL(15)
+#endif
+
+
+/** SEGMENT SORT KERNEL **/
+
+//Each group sorts segments of input into output (the same buffer to sort
+//in place) in local memory: the keys are loaded, sorted by one stable split
+//per bit that varies in the segment (by rank, if an item has one key at
+//most) and written back. offsets holds where
+//every segment starts and ends, segments[1..nsegments] lists the ones of
+//the launch. The groups take them in turn off the ticket on segments[0], so
+//groups that finish early take more and skewed sizes stay balanced.
+//local_keys holds two copies of up to capacity keys, src and dst alternate
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void sort_segments(__global rs_key* input,
+                   __global rs_key* output,
+                   __global const int* offsets,
+                   volatile __global int* segments,
+                   __local rs_key* local_keys,
+                   __local int* local_sums,
+                   const int capacity,
+                   const int nsegments)
 {
+    uint l_id = (uint) get_local_id(0);
 
-    uint g_id = (uint) get_global_id(0);
-    uint group_id = (uint) get_group_id(0);
+    __local int local_ticket;
+    int i, k, d;
+    for(;;) {
+        //Next segment (the barrier also waits for the last one's keys to
+        //be written out)
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(l_id == 0)
+            local_ticket = atomic_inc(&segments[0]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if(local_ticket >= nsegments)
+            return;
+        int segment = segments[1 + local_ticket];
+        int begin = offsets[segment];
+        int nkeys = offsets[segment + 1] - begin;
+        int src = 0, dst = capacity;
+
+        for(i = l_id; i < nkeys; i += WG_SIZE)
+            local_keys[i] = encode(input[begin + i]);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    int b = block_sums[group_id];
+        //Up to a key per item (most MSD buckets): each item writes its key
+        //at its rank, the keys smaller than it and its equals before it
+        if(nkeys <= WG_SIZE) {
+            if(l_id < nkeys) {
+                rs_key item = local_keys[l_id];
+                int rank = 0;
+                for(k = 0; k < nkeys; k++) {
+                    rs_key other = local_keys[k];
+                    rank += other < item || (other == item && k < (int)l_id);
+                }
+                output[begin + rank] = decode(item);
+            }
+            continue;
+        }
 
-    //TODO: Probar pasar a memoria local
-    scan[2 * g_id] += b;
-    scan[2 * g_id + 1] += b;
+        //Bits that vary in the segment: the ones its keys OR to and not AND
+        //to (each item reduces its keys, then the group reduces the items in dst)
+        rs_key any = 0, all = ALL_BITS;
+        for(i = l_id; i < nkeys; i += WG_SIZE) {
+            any |= local_keys[i];
+            all &= local_keys[i];
+        }
+        local_keys[dst + l_id] = any;
+        local_keys[dst + WG_SIZE + l_id] = all;
+        for(d = 1; d < WG_SIZE; d <<= 1) {
+            barrier(CLK_LOCAL_MEM_FENCE);
+            if(l_id % (2 * d) == 0 && l_id + d < WG_SIZE) {
+                local_keys[dst + l_id] |= local_keys[dst + l_id + d];
+                local_keys[dst + WG_SIZE + l_id] &= local_keys[dst + WG_SIZE + l_id + d];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        rs_key varying = local_keys[dst] ^ local_keys[dst + WG_SIZE];
+
+        //Each item splits a contiguous run of the segment
+        int per_item = (nkeys + WG_SIZE - 1) / WG_SIZE;
+        int first = min((int)l_id * per_item, nkeys);
+        int last = min(first + per_item, nkeys);
+
+        //Stable split on each varying bit, zeros before ones
+        int bit;
+        for(bit = 0; bit < BITS; bit++) {
+            if(!((varying >> bit) & 1))
+                continue;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            int zeros = 0;
+            for(k = first; k < last; k++)
+                zeros += !((local_keys[src + k] >> bit) & 1);
+            int zero_pos = group_scan(local_sums, zeros);
+            int one_pos = local_sums[WG_SIZE - 1] + first - zero_pos;
+            for(k = first; k < last; k++) {
+                rs_key item = local_keys[src + k];
+                local_keys[dst + (((item >> bit) & 1) ? one_pos++ : zero_pos++)] = item;
+            }
+            int tmp = src;
+            src = dst;
+            dst = tmp;
+        }
 
-    barrier(CLK_GLOBAL_MEM_FENCE);
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(i = l_id; i < nkeys; i += WG_SIZE)
+            output[begin + i] = decode(local_keys[src + i]);
+    }
 }
 
 
+/** SELECT KERNELS **/
 
-/** REORDER KERNEL **/
-__kernel void reorder(__global int* array,
-                      __global int* histo,
-                      __global int* output,
-                      const int pass,
-                      const int nkeys,
-                      __local int* local_histo)
+//Appends the key of each item that keeps it to output, after the keys
+//appended before (counted on counter), in any order. Every item of the
+//group calls it
+void append_key(__global rs_key* output,
+                __global int* counter,
+                __local int* local_append,
+                rs_key key,
+                int keep)
+{
+    uint l_id = (uint) get_local_id(0);
+
+    if(l_id == 0)
+        local_append[0] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int slot = keep ? atomic_inc(&local_append[0]) : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(l_id == 0 && local_append[0])
+        local_append[1] = atomic_add(counter, local_append[0]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(keep)
+        output[local_append[1] + slot] = key;
+}
+
+//One round of a radix select, from the top digit down: counts the digits
+//at shift of the keys of input (from input_offset) whose bits under mask
+//are prefix, added to counts[0..BUCK). With compact, those keys are also
+//appended to output (from output_offset, counted on counts[BUCK]), so the
+//next rounds read only them
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void select_digits(const __global rs_key* input,
+                   const int input_offset,
+                   const int nkeys,
+                   __global rs_key* output,
+                   const int output_offset,
+                   __global int* counts,
+                   __local int* local_histo,
+                   const rs_key prefix,
+                   const rs_key mask,
+                   const int shift,
+                   const int compact)
 {
-    uint g_id = (uint) get_global_id(0);
     uint l_id = (uint) get_local_id(0);
-    uint l_size = (uint) get_local_size(0);    
 
     uint group_id = (uint) get_group_id(0);
-    uint n_groups = (uint) get_num_groups(0); 
+    uint n_groups = (uint) get_num_groups(0);
 
-    //Bring histo to local memory
+    __local int local_append[2];
     int i;
-    for(i = 0; i < BUCK; i++){
-        int to = i * n_groups + group_id;
-        local_histo[i * l_size + l_id] = 
-            histo[l_size * to + l_id];
-    }
-    
+    for(i = l_id; i < BUCK; i += WG_SIZE)
+        local_histo[i] = 0;
+
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    //Write to global memory in order
-    int size = (nkeys / n_groups) / l_size;
-    int start = g_id * size;
+    //Each group takes a contiguous block, a key per item at a time (the
+    //appends of a group go out together)
+    int size = (nkeys + n_groups - 1) / n_groups;
+    int start = min((int)group_id * size, nkeys);
+    int end = min(start + size, nkeys);
+    input += input_offset;
+    output += output_offset;
+
+    int base;
+    for(base = start; base < end; base += WG_SIZE) {
+        i = base + l_id;
+        rs_key key = 0;
+        int keep = 0;
+        if(i < end) {
+            key = input[i];
+            rs_key item = encode(key);
+            keep = (item & mask) == prefix;
+            if(keep)
+                atomic_inc(&local_histo[(int)((item >> shift) & (BUCK - 1))]);
+        }
+        if(compact)
+            append_key(output, &counts[BUCK], local_append, key, keep);
+    }
 
-    for(i = 0; i < size; i++){
-        int item = array[i + start];
-        int key = (item >> (pass * RADIX)) & (BUCK - 1);
-        int pos = local_histo[key * l_size + l_id];
-        local_histo[key * l_size + l_id]++;
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        output[pos] = item;
+    for(i = l_id; i < BUCK; i += WG_SIZE) {
+        if(local_histo[i])
+            atomic_add(&counts[i], local_histo[i]);
     }
-    
-    barrier(CLK_GLOBAL_MEM_FENCE);
 }
 
-
-/** CHECK ORDER KERNELS **/
-
-__kernel void parallelcmp(const __global int* input,
-                    __global int* output,
-                    const int nkeys)
+//Appends the keys of input below the encoded threshold (or above it, with
+//above) to output, counted on counter
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void gather_keys(const __global rs_key* input,
+                 const int nkeys,
+                 __global rs_key* output,
+                 __global int* counter,
+                 const rs_key threshold,
+                 const int above)
 {
-    uint g_id = (uint) get_global_id(0);
-    uint l_size = (uint) get_local_size(0);    
-    uint n_groups = (uint) get_num_groups(0); 
-    
-    //Calculate elements to process per item
-    int size = (nkeys / n_groups) / l_size;
-    //Calculate where to start on the global array
-    int start = g_id * size;
-
-    //Set the output to 0
-    int i;
-    for(i = 0; i < size; i++) {
-        output[i + start] = 0;
+    uint group_id = (uint) get_group_id(0);
+    uint n_groups = (uint) get_num_groups(0);
+
+    __local int local_append[2];
+    int size = (nkeys + n_groups - 1) / n_groups;
+    int start = min((int)group_id * size, nkeys);
+    int end = min(start + size, nkeys);
+
+    int base;
+    for(base = start; base < end; base += WG_SIZE) {
+        int i = base + (int) get_local_id(0);
+        rs_key key = 0;
+        int keep = 0;
+        if(i < end) {
+            key = input[i];
+            rs_key item = encode(key);
+            keep = above ? item > threshold : item < threshold;
+        }
+        append_key(output, counter, local_append, key, keep);
     }
+}
 
-    barrier(CLK_LOCAL_MEM_FENCE);
 
-    for(i = 0; i < size; i++) {
-        if (g_id == 0 && i == 0) {
-            ;
-        }
-        else if (input[i + start] < input[i + start - 1])
-            output[i + start] = 1;
+/** VERIFY KERNEL **/
+
+//First of the nbounds ascending bounds above i (nbounds if none)
+int bound_above(const __global int* bounds, int nbounds, int i)
+{
+    int lo = 0, hi = nbounds;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(bounds[mid] <= i)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    barrier(CLK_LOCAL_MEM_FENCE);
+    return lo;
 }
 
-__kernel void reduce(__global int* input,
-                     __global int* output,
-                    const int nkeys)
+//Checks the sorted keys while they are still on the device: counts the keys
+//smaller than the one before them and adds the checksum of the output to
+//check, to compare with the one of the input. Each item accumulates its
+//keys, each group its items in local memory, and then check the groups.
+//With nbounds bounds (segments sorted apart, none: one run of nkeys), a key
+//is only compared with the one before it in its segment
+__kernel __attribute__((reqd_work_group_size(WG_SIZE, 1, 1)))
+void verify(const __global rs_key* input,
+            __global uint* check,
+            const int nkeys,
+            const __global int* bounds,
+            const int nbounds)
 {
-    uint g_id = (uint) get_global_id(0);
     uint l_id = (uint) get_local_id(0);
-    uint l_size = (uint) get_local_size(0);    
 
     uint group_id = (uint) get_group_id(0);
     uint n_groups = (uint) get_num_groups(0); 
 
-    //UP SWEEP
-    int d, offset = 1;
-    for(d = l_size; d > 0; d >>= 1){
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if(l_id < d) {
-            int a = offset * (2 * l_id + 1) - 1;
-            int b = offset * (2 * l_id + 2) - 1;
-            input[b] += input[a];
+    __local uint local_check[3];
+    if(l_id < 3)
+        local_check[l_id] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    //Same blocks of whole vectors as the histogram
+    int size = (nkeys + n_groups - 1) / n_groups;
+    size = (size + VECTOR_KEYS - 1) / VECTOR_KEYS * VECTOR_KEYS;
+    int start = min((int)group_id * size, nkeys);
+    int end = min(start + size, nkeys);
+    int vector_end = end - (end - start) % VECTOR_KEYS;
+
+    //The keys are compared as the passes see them (encoded)
+    uint sum = 0, mix = 0, inversions = 0;
+    int i, k;
+    for(i = start + l_id * VECTOR_KEYS; i < vector_end; i += WG_SIZE * VECTOR_KEYS) {
+        rs_key keys[VECTOR_KEYS];
+        load_keys(input + i, keys);
+        rs_key before = (i > 0) ? encode(input[i - 1]) : 0;
+        int next = bound_above(bounds, nbounds, i);
+        for(k = 0; k < VECTOR_KEYS; k++) {
+            rs_key item = encode(keys[k]);
+            //The bound below the key, if it is the key's own, starts a segment
+            while(next < nbounds && bounds[next] <= i + k)
+                next++;
+            int joined = nbounds == 0 || (next > 0 && next < nbounds && bounds[next - 1] < i + k);
+            inversions += joined && item < before;
+            before = item;
+            sum += key_hash(keys[k], CHECK_SEED_SUM);
+            mix ^= key_hash(keys[k], CHECK_SEED_XOR);
         }
-        offset *= 2;
     }
-    
+    for(i = vector_end + l_id; i < end; i += WG_SIZE) {
+        int next = bound_above(bounds, nbounds, i);
+        int joined = nbounds == 0 || (next > 0 && next < nbounds && bounds[next - 1] < i);
+        inversions += (i > 0) && joined && encode(input[i]) < encode(input[i - 1]);
+        sum += key_hash(input[i], CHECK_SEED_SUM);
+        mix ^= key_hash(input[i], CHECK_SEED_XOR);
+    }
+    atomic_add(&local_check[0], sum);
+    atomic_xor(&local_check[1], mix);
+    atomic_add(&local_check[2], inversions);
+
     barrier(CLK_LOCAL_MEM_FENCE);
-    if(g_id == 0)
-        output[0] = input[nkeys - 1];
+
+    if(l_id == 0) {
+        atomic_add(&check[CHECK_SUM_OUT], local_check[0]);
+        atomic_xor(&check[CHECK_XOR_OUT], local_check[1]);
+        atomic_add(&check[CHECK_INVERSIONS], local_check[2]);
+    }
 }
@@ -14,8 +14,10 @@
 #ifndef _RADIXSORT_H_
 #define _RADIXSORT_H_
 
-//Kernel file name
+//Kernel file name, and the directory it is read from with radixsort.h
+//(RS_KERNELS_DIR overrides it)
 #define KERNELS_FILENAME "radixsort.cl"
+#define KERNELS_DIR "."
 
 //Max source size for the kernels file (radixsort.cl)
 #define MAX_SOURCE_SIZE 0x100000
@@ -23,23 +25,236 @@
 //Maximum length of a kernel in the kernels file (radixsort.cl)
 #define MAX_KERNEL_NAME 20
 
+//Directory for the compiled programs cache (RS_CACHE_DIR overrides it, empty disables it)
+#define CACHE_DIR ".clcache"
 
-//Number of items in a work-group
+
+//Number of items in a work-group (the kernels are built with it)
+#ifndef WG_SIZE
 #define WG_SIZE 128
-//Number of groups in a device
-#define N_GROUPS 16
+#endif
+//Maximum number of groups of a sort (the actual number scales with the input)
+#define MAX_GROUPS 256
+//Keys per item to reach before a sort uses more groups
+#define KEYS_PER_ITEM 16
+//Keys per item in a tile of the reorder local sort (the kernels are built with it)
+#ifndef TILE_KEYS
+#define TILE_KEYS 4
+#endif
+//Keys per vector load of the kernels (4 or 8, picked for the device)
+#ifndef VECTOR_KEYS
+#define VECTOR_KEYS 4
+#endif
+//Sessions the chunks of an out-of-core sort alternate on (the transfers of
+//one overlap the kernels of another)
+#define OOC_PIPELINES 2
+//Fewest keys per thread of the out-of-core merge
+#define OOC_MERGE_KEYS (1 << 16)
+//Sessions the batches of a sort stream alternate on (one context, a queue
+//and buffers each: the upload of one, the passes of another and the
+//download of a third overlap), and batches each one holds queued before a
+//submit waits
+#define STREAM_PIPELINES 3
+#define STREAM_DEPTH 8
+//Keys sampled per device to split a multi-device sort
+#define MULTI_SAMPLES 256
+//Fewest keys a multi-device sort splits (fewer go to the fastest device)
+#define MULTI_MIN_KEYS (1 << 16)
+//Fewest keys per thread of the native backend
+#define NATIVE_THREAD_KEYS (1 << 16)
+//Bytes per digit of the native scatter write-combining buffers
+#define NATIVE_WC_BYTES 64
+//Most distinct keys of a sort written as runs from their counts (the
+//values are found on DISTINCT_SAMPLES keys of inputs of DISTINCT_MIN_KEYS
+//or more, the regular passes sort the rest)
+#define DISTINCT_KEYS 256
+#define DISTINCT_SAMPLES 2048
+#define DISTINCT_MIN_KEYS (1 << 16)
+
+
+//Key types (the kernels are specialized with -DKEY_TYPE=...)
+#define RS_UINT32 0
+#define RS_INT32  1
+#define RS_UINT64 2
+#define RS_INT64  3
+#define RS_FLOAT  4
+#define RS_DOUBLE 5
+//Size in bytes of a key type
+#define KEY_SIZE(type) (((type) == RS_UINT64 || (type) == RS_INT64 || (type) == RS_DOUBLE) ? 8 : 4)
+
+//value_words of the reorder kernel that generates the key indices (argsort)
+#define INDEX_VALUES -1
+
+//Pass flags of count and reorder (passes whose digit never varies are skipped)
+#define PASS_FIRST 0x1  //First pass run: encode the keys
+#define PASS_LAST  0x2  //Last pass run: decode the keys
+
+//Look-back state of the reorder tiles: a word per tile per digit with the
+//count of that digit in the tile (aggregate) or in the tiles up to it
+//(prefix), flagged on the 2 low bits (0 while not published)
+#define LOOKBACK_AGGREGATE 0x1
+#define LOOKBACK_PREFIX    0x2
+#define LOOKBACK(count, flag) ((int)(((unsigned int)(count) << 2) | (flag)))
+//The counts take the other 30 bits, so a sort (or select) on a device takes
+//up to LOOKBACK_MAX_KEYS keys; sessions sort larger inputs on the host, as
+//the native backend does
+#define LOOKBACK_MAX_KEYS (1 << 30)
 
+//Words of the verification buffer: the multiset checksum (a sum and a xor
+//of key hashes) of the input and of the output, and the keys smaller than
+//the one before them in the output
+#define CHECK_SUM_IN     0
+#define CHECK_XOR_IN     1
+#define CHECK_SUM_OUT    2
+#define CHECK_XOR_OUT    3
+#define CHECK_INVERSIONS 4
+#define CHECK_WORDS      5
+//Seeds of the two hashes of the multiset checksum
+#define CHECK_SEED_SUM 0x9e3779b9u
+#define CHECK_SEED_XOR 0x7f4a7c15u
 
-//Number of total bits in the integers to sort
-#define BITS 32
 //Number of buckets necessary
 #define BUCK (1 << RADIX)
-//Number of bits in the radix
-#define RADIX 4
+//Number of bits in the radix (default of the sessions, the kernels are
+//built with theirs: 4, 6, 8 or 11)
+#ifndef RADIX
+#define RADIX 8
+#endif
 
 
 /*Testing functions*/
 //Size of the array to order (if _RS_FILLFUN_ not defined, generateArray will create a random one).
 #define ARRLEN 2048
 
+
+/*Host API (the kernels include this file too, so keep it out of their way)*/
+#ifndef __OPENCL_VERSION__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <CL/opencl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Builds a program from source, or loads it from the binaries cache
+cl_program rs_build_program(cl_context context, cl_device_id device, const char *file_name, const char *options);
+//Keys per vector load that suit device (its preferred vector width)
+int rs_vector_keys(cl_device_id device, int keySize);
+
+//Sort session: keeps the openCL context, program, kernels and buffers alive
+typedef struct rs_session rs_session;
+
+//Session flags
+#define RS_PROFILE   0x1  //Time every enqueued command (see rs_session_report)
+#define RS_VERIFY    0x2  //Check every sort on the device (see rs_session_verify)
+#define RS_ZERO_COPY 0x4  //Sort in the caller's arrays (default on host-unified devices)
+#define RS_SUBDEVICES 0x8 //Multi-device sorts split CPU devices by NUMA node
+#define RS_NATIVE    0x10 //Sort on host threads (also with RS_BACKEND=native, or without openCL)
+#define RS_MSD       0x20 //Sort keys from the top digit down, buckets finished in local memory
+#define RS_RADIX(bits) ((bits) << 8)  //Bits per digit: 4, 6, 8 or 11 (default RADIX)
+#define RS_RADIX_BITS(flags) (((flags) >> 8) & 0xff)
+
+//Profiled stages
+#define RS_STAGE_WRITE     0
+#define RS_STAGE_HISTOGRAM 1
+#define RS_STAGE_REORDER   2
+#define RS_STAGE_READ      3
+#define RS_STAGE_VERIFY    4
+#define RS_STAGES          5
+
+//Creates a session for keys of keyType (RS_INT32...)
+rs_session *rs_session_create(int keyType, int flags);
+//Creates it on device (the other one takes the first of the first platform)
+rs_session *rs_session_create_on(cl_device_id device, int keyType, int flags);
+//Creates it on the native backend (host threads, see RS_NATIVE)
+rs_session *rs_session_create_native(int keyType, int flags);
+//Creates another session like s on its context and program (its own queue and buffers)
+rs_session *rs_session_create_shared(rs_session *s);
+//Returns a sorted (malloc'd) copy of array, which holds keys of the session type
+void *rs_session_sort(rs_session *s, const void *array, int size);
+//Sorts array, which holds keys of the session type, in place
+void rs_session_sort_inplace(rs_session *s, void *array, int size);
+//Sorts array into output (size keys of the session type each)
+void rs_session_sort_into(rs_session *s, const void *array, void *output, int size);
+//Most keys a sort can take on the session device
+int rs_session_max_keys(rs_session *s);
+//Sorts keys and their values (valueSize bytes each, 4 or 8) by key, in place
+void rs_session_sort_pairs(rs_session *s, void *keys, void *values, int valueSize, int size);
+//Returns the (malloc'd) stable permutation that sorts keys, without moving them
+int *rs_session_argsort(rs_session *s, const void *keys, int size);
+//Writes that permutation into perm (size ints)
+void rs_session_argsort_into(rs_session *s, const void *keys, int *perm, int size);
+//Sorts each segment of array (segment i from offsets[i] to offsets[i + 1])
+//in place, the small ones in a single launch (RS_VERIFY checks each segment)
+void rs_session_sort_segments(rs_session *s, void *array, const int *offsets, int nsegments);
+//Writes to nth the key sorting array would leave at position n (radix select)
+void rs_session_nth_element(rs_session *s, const void *array, int size, int n, void *nth);
+//Writes the k smallest keys of array to output, in order
+void rs_session_partial_sort(rs_session *s, const void *array, void *output, int size, int k);
+//Writes the k largest keys of array to output, largest first
+void rs_session_top_k(rs_session *s, const void *array, void *output, int size, int k);
+void rs_session_destroy(rs_session *s);
+
+//Prints the profile of the last sort as JSON
+void rs_session_report(rs_session *s, FILE *out);
+//Returns the keys out of order in the output of the last sort (needs
+//RS_VERIFY), and sets *sameKeys to whether it holds the input keys
+int rs_session_verify(rs_session *s, int *sameKeys);
+
+//One-shot sort (creates and destroys a session)
+int *radixsort(int *array, int size);
+//Order-preserving unsigned bits of a key of keyType
+uint64_t rs_key_bits(const void *key, int keyType);
+
+//Buffers and pool threads of a session's native sorts (they only grow)
+typedef struct rs_native_workspace rs_native_workspace;
+//Native backend of the sessions: sorts like them (see rs_sort) on host threads
+//(its buffers and threads come from *workspace, created on first use)
+void rs_native_sort(int keyType, int radix, void *array, void *output, void *values, void *values_output, int valueWords, int size,
+                    rs_native_workspace **workspace);
+//Stops the threads of a workspace and frees it
+void rs_native_release(rs_native_workspace *workspace);
+//Adds the checksum of keys (in the order of perm, if any) to the input or
+//output words of check, and the output keys out of order
+void rs_native_check(int keyType, const void *keys, const int *perm, int size, cl_uint *check, int output);
+//Radix select and the gather of the keys below (or above) it on the host
+uint64_t rs_native_select(int keyType, int radix, const void *keys, int size, int rank, rs_native_workspace **workspace);
+int rs_native_gather(int keyType, const void *keys, int size, uint64_t bits, int above, void *output);
+
+//Sorts the file input, which holds keys of keyType, into the file output
+//in chunks of chunkKeys keys (0: as many as fit in the device) merged on
+//the host; flags are the ones of the chunk sessions
+void rs_sort_file(const char *input, const char *output, int keyType, int flags, size_t chunkKeys);
+
+//Multi-device sort: a session per device of every platform
+typedef struct rs_multi rs_multi;
+rs_multi *rs_multi_create(int keyType, int flags);
+//Returns a sorted (malloc'd) copy of array, split across the devices by speed
+void *rs_multi_sort(rs_multi *m, const void *array, int size);
+//Number of devices the sorts are split across
+int rs_multi_devices(rs_multi *m);
+void rs_multi_destroy(rs_multi *m);
+
+//Asynchronous sort stream: batches sorted on STREAM_PIPELINES sessions in turn
+typedef struct rs_stream rs_stream;
+//Called on a stream thread once a batch is sorted into output
+typedef void (*rs_stream_done)(void *output, int size, void *user);
+rs_stream *rs_stream_create(int keyType, int flags);
+//Queues the sort of array into output (the caller keeps both until it is
+//done) and returns the batch number; done, if any, is called after it
+long rs_stream_submit(rs_stream *st, const void *array, void *output, int size, rs_stream_done done, void *user);
+//Waits for a batch to be sorted (and its done call to return)
+void rs_stream_wait(rs_stream *st, long batch);
+//Waits for every batch submitted so far
+void rs_stream_flush(rs_stream *st);
+void rs_stream_destroy(rs_stream *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*__OPENCL_VERSION__*/
+
 #endif /*_RADIXSORT_H_*/
@@ -0,0 +1,209 @@
+/*
+ *                   RADIXSORT.HPP
+ *
+ * "radixsort.hpp" is the C++ interface of the Radix Sort library:
+ * a sort session that owns its rs_session and sorts std::span
+ * arrays into the caller's memory, and a sort stream whose
+ * batches return futures (C++20).
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+
+#ifndef _RADIXSORT_HPP_
+#define _RADIXSORT_HPP_
+
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <utility>
+
+#include "radixsort.h"
+
+namespace rs {
+
+//Key type (RS_INT32...) of each C++ key
+template<typename Key> struct key_type;
+template<> struct key_type<uint32_t> { static constexpr int value = RS_UINT32; };
+template<> struct key_type<int32_t>  { static constexpr int value = RS_INT32; };
+template<> struct key_type<uint64_t> { static constexpr int value = RS_UINT64; };
+template<> struct key_type<int64_t>  { static constexpr int value = RS_INT64; };
+template<> struct key_type<float>    { static constexpr int value = RS_FLOAT; };
+template<> struct key_type<double>   { static constexpr int value = RS_DOUBLE; };
+
+namespace detail {
+    //Spans of a sort: the same size, and not more keys than an int counts
+    inline void check_size(size_t size, size_t other) {
+        if(size != other)
+            throw std::invalid_argument("radixsort: spans of different sizes");
+        if(size > static_cast<size_t>(std::numeric_limits<int>::max()))
+            throw std::length_error("radixsort: too many keys for one sort");
+    }
+}
+
+
+//**********************************************
+// session
+//
+//   Sort session for Key keys (flags as in
+//   rs_session_create). Sorts write into the
+//   spans given, so once its buffers have grown
+//   a session allocates nothing per sort (but
+//   the buffers a zero-copy one wraps them in)
+//**********************************************
+template<typename Key>
+class session {
+public:
+    explicit session(int flags = 0)
+        : s_(rs_session_create(key_type<Key>::value, flags)) {}
+    ~session() {
+        if(s_)
+            rs_session_destroy(s_);
+    }
+
+    session(const session&) = delete;
+    session& operator=(const session&) = delete;
+    session(session&& other) noexcept : s_(std::exchange(other.s_, nullptr)) {}
+    session& operator=(session&& other) noexcept {
+        if(this != &other) {
+            if(s_)
+                rs_session_destroy(s_);
+            s_ = std::exchange(other.s_, nullptr);
+        }
+        return *this;
+    }
+
+    //Sorts input into output (same size)
+    void sort(std::span<const Key> input, std::span<Key> output) {
+        check_size(input.size(), output.size());
+        rs_session_sort_into(s_, input.data(), output.data(), static_cast<int>(input.size()));
+    }
+
+    //Sorts keys in place
+    void sort(std::span<Key> keys) {
+        check_size(keys.size(), keys.size());
+        rs_session_sort_inplace(s_, keys.data(), static_cast<int>(keys.size()));
+    }
+
+    //Sorts keys and their values (32 or 64-bit each) by key, in place
+    template<typename Value>
+    void sort_pairs(std::span<Key> keys, std::span<Value> values) {
+        static_assert(sizeof(Value) == 4 || sizeof(Value) == 8, "values must be 32 or 64-bit");
+        check_size(keys.size(), values.size());
+        rs_session_sort_pairs(s_, keys.data(), values.data(), sizeof(Value), static_cast<int>(keys.size()));
+    }
+
+    //Writes the stable permutation that sorts keys into perm
+    void argsort(std::span<const Key> keys, std::span<int> perm) {
+        check_size(keys.size(), perm.size());
+        rs_session_argsort_into(s_, keys.data(), perm.data(), static_cast<int>(keys.size()));
+    }
+
+    //Sorts each segment of keys (segment i from offsets[i] to offsets[i + 1]) in place
+    void sort_segments(std::span<Key> keys, std::span<const int> offsets) {
+        if(offsets.empty())
+            return;
+        if(offsets.front() < 0 || static_cast<size_t>(offsets.back()) > keys.size())
+            throw std::out_of_range("radixsort: segments out of the keys");
+        rs_session_sort_segments(s_, keys.data(), offsets.data(), static_cast<int>(offsets.size() - 1));
+    }
+
+    //The key sorting keys would leave at position n
+    Key nth_element(std::span<const Key> keys, size_t n) {
+        if(n >= keys.size())
+            throw std::out_of_range("radixsort: position out of the keys");
+        check_size(keys.size(), keys.size());
+        Key nth;
+        rs_session_nth_element(s_, keys.data(), static_cast<int>(keys.size()), static_cast<int>(n), &nth);
+        return nth;
+    }
+
+    //Writes the smallest keys (as many as output takes) to output, in order
+    void partial_sort(std::span<const Key> keys, std::span<Key> output) {
+        if(output.size() > keys.size())
+            throw std::out_of_range("radixsort: more keys taken than given");
+        check_size(keys.size(), keys.size());
+        rs_session_partial_sort(s_, keys.data(), output.data(), static_cast<int>(keys.size()), static_cast<int>(output.size()));
+    }
+
+    //Writes the largest keys (as many as output takes) to output, largest first
+    void top_k(std::span<const Key> keys, std::span<Key> output) {
+        if(output.size() > keys.size())
+            throw std::out_of_range("radixsort: more keys taken than given");
+        check_size(keys.size(), keys.size());
+        rs_session_top_k(s_, keys.data(), output.data(), static_cast<int>(keys.size()), static_cast<int>(output.size()));
+    }
+
+    //The C session (for the calls without a wrapper)
+    rs_session *get() const { return s_; }
+
+private:
+    static void check_size(size_t size, size_t other) { detail::check_size(size, other); }
+
+    rs_session *s_;
+};
+
+
+//**********************************************
+// stream
+//
+//   Sort stream for Key keys (flags as in
+//   rs_session_create). Each batch submitted
+//   returns a future, ready once the batch is
+//   sorted into its output
+//**********************************************
+template<typename Key>
+class stream {
+public:
+    explicit stream(int flags = 0)
+        : s_(rs_stream_create(key_type<Key>::value, flags)) {}
+    ~stream() {
+        if(s_)
+            rs_stream_destroy(s_);
+    }
+
+    stream(const stream&) = delete;
+    stream& operator=(const stream&) = delete;
+    stream(stream&& other) noexcept : s_(std::exchange(other.s_, nullptr)) {}
+    stream& operator=(stream&& other) noexcept {
+        if(this != &other) {
+            if(s_)
+                rs_stream_destroy(s_);
+            s_ = std::exchange(other.s_, nullptr);
+        }
+        return *this;
+    }
+
+    //Queues the sort of input into output (both kept alive until the future is ready)
+    std::future<void> submit(std::span<const Key> input, std::span<Key> output) {
+        detail::check_size(input.size(), output.size());
+        auto *promise = new std::promise<void>();
+        std::future<void> future = promise->get_future();
+        rs_stream_submit(s_, input.data(), output.data(), static_cast<int>(input.size()), &stream::done, promise);
+        return future;
+    }
+
+    //Waits for every batch submitted so far
+    void flush() { rs_stream_flush(s_); }
+
+    //The C stream (for the calls without a wrapper)
+    rs_stream *get() const { return s_; }
+
+private:
+    static void done(void *, int, void *user) {
+        auto *promise = static_cast<std::promise<void>*>(user);
+        promise->set_value();
+        delete promise;
+    }
+
+    rs_stream *s_;
+};
+
+} //namespace rs
+
+#endif /*_RADIXSORT_HPP_*/
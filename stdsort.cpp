@@ -0,0 +1,25 @@
+/*
+ *                  STDSORT.CPP
+ *
+ * "stdsort.cpp" gives the benchmark (bench.c) its std::sort
+ * baseline, callable from C.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <algorithm>
+#include <stdint.h>
+
+
+//std::sort of 32 and 64-bit unsigned keys
+extern "C" void std_sort_u32(uint32_t *keys, int size) {
+    std::sort(keys, keys + size);
+}
+
+extern "C" void std_sort_u64(uint64_t *keys, int size) {
+    std::sort(keys, keys + size);
+}
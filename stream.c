@@ -0,0 +1,190 @@
+/*
+ *                    STREAM.C
+ *
+ * "stream.c" sorts a stream of batches asynchronously: batches
+ * are queued on a few sort sessions in turn, which share one
+ * context and program but have their own queue, device buffers
+ * and host thread, so the upload of one batch, the passes of
+ * another and the download of a third run at the same time.
+ * The caller gets a callback, or waits on the batch number,
+ * once a batch is sorted.
+ *
+ * 2016 Project for the "Facultad de Ciencias Exactas, Ingenieria
+ * y Agrimensura" (FCEIA), Rosario, Santa Fe, Argentina.
+ *
+ * Implementation by Paoloni Gianfranco and Soncini Nicolas.
+ */
+
+//System includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+//OpenCL includes
+#include <CL/opencl.h>
+
+//Kernel includes
+#include "radixsort.h"
+
+
+//Batch submitted to a stream
+typedef struct {
+    const void *array;
+    void *output;
+    int size;
+    rs_stream_done done;
+    void *user;
+} rs_stream_batch;
+
+//A session, the thread that sorts on it and its batches (a ring of
+//STREAM_DEPTH, from the next one to sort to the last one queued)
+typedef struct {
+    rs_stream *stream;
+    rs_session *session;
+    pthread_t thread;
+    rs_stream_batch batches[STREAM_DEPTH];
+    long queued, sorted;
+} rs_stream_pipeline;
+
+
+//**********************************************
+// Sort stream
+//
+//   Batch b goes to pipeline b % STREAM_PIPELINES
+//   (its b / STREAM_PIPELINES-th), so batches of
+//   similar sizes keep every pipeline busy. The
+//   lock guards the rings and counts, changed is
+//   signaled when any of them moves
+//**********************************************
+struct rs_stream {
+    rs_stream_pipeline pipelines[STREAM_PIPELINES];
+    long submitted;
+    int closing;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+
+//Sorts the batches of a pipeline as they are queued, until the stream closes
+static void *rs_stream_run(void *arg) {
+    rs_stream_pipeline *p = (rs_stream_pipeline*)arg;
+    rs_stream *st = p->stream;
+
+    pthread_mutex_lock(&st->lock);
+    for(;;) {
+        while(p->sorted == p->queued && !st->closing)
+            pthread_cond_wait(&st->changed, &st->lock);
+        if(p->sorted == p->queued)
+            break;
+        rs_stream_batch batch = p->batches[p->sorted % STREAM_DEPTH];
+        pthread_mutex_unlock(&st->lock);
+
+        rs_session_sort_into(p->session, batch.array, batch.output, batch.size);
+        if(batch.done)
+            batch.done(batch.output, batch.size, batch.user);
+
+        pthread_mutex_lock(&st->lock);
+        p->sorted++;
+        pthread_cond_broadcast(&st->changed);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+
+//**********************************************
+// rs_stream_create
+//
+//   Creates STREAM_PIPELINES sessions for keys
+//   of keyType (flags as in rs_session_create)
+//   on one context and program, each with its
+//   own in-order queue and buffers, and starts
+//   their threads
+//**********************************************
+rs_stream *rs_stream_create(int keyType, int flags) {
+    rs_stream *st = (rs_stream*)calloc(1, sizeof(rs_stream));
+    if(!st) {
+        printf("Error allocating the stream\n");
+        exit(1);
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->changed, NULL);
+
+    int p;
+    for(p = 0; p < STREAM_PIPELINES; p++) {
+        st->pipelines[p].stream = st;
+        st->pipelines[p].session = p ? rs_session_create_shared(st->pipelines[0].session) : rs_session_create(keyType, flags);
+    }
+    for(p = 0; p < STREAM_PIPELINES; p++)
+        pthread_create(&st->pipelines[p].thread, NULL, rs_stream_run, &st->pipelines[p]);
+    return st;
+}
+
+
+//**********************************************
+// rs_stream_submit
+//
+//   Queues the sort of array into output on the
+//   next pipeline, and returns the number of the
+//   batch. Waits while that pipeline already has
+//   STREAM_DEPTH batches queued, and only then
+//   takes the number, so each pipeline holds its
+//   batches in number order
+//**********************************************
+long rs_stream_submit(rs_stream *st, const void *array, void *output, int size, rs_stream_done done, void *user) {
+    rs_stream_batch batch = {array, output, size, done, user};
+
+    pthread_mutex_lock(&st->lock);
+    rs_stream_pipeline *p;
+    for(;;) {
+        p = &st->pipelines[st->submitted % STREAM_PIPELINES];
+        if(p->queued - p->sorted < STREAM_DEPTH)
+            break;
+        pthread_cond_wait(&st->changed, &st->lock);
+    }
+    long number = st->submitted++;
+    p->batches[p->queued % STREAM_DEPTH] = batch;
+    p->queued++;
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    return number;
+}
+
+
+//Waits for batch to be sorted (and its done call to return)
+void rs_stream_wait(rs_stream *st, long batch) {
+    rs_stream_pipeline *p = &st->pipelines[batch % STREAM_PIPELINES];
+    pthread_mutex_lock(&st->lock);
+    while(p->sorted <= batch / STREAM_PIPELINES)
+        pthread_cond_wait(&st->changed, &st->lock);
+    pthread_mutex_unlock(&st->lock);
+}
+
+
+//Waits for every batch submitted so far
+void rs_stream_flush(rs_stream *st) {
+    int p;
+    pthread_mutex_lock(&st->lock);
+    for(p = 0; p < STREAM_PIPELINES; p++)
+        while(st->pipelines[p].sorted < st->pipelines[p].queued)
+            pthread_cond_wait(&st->changed, &st->lock);
+    pthread_mutex_unlock(&st->lock);
+}
+
+
+//Sorts the batches left, then stops the threads and destroys the sessions
+void rs_stream_destroy(rs_stream *st) {
+    int p;
+    pthread_mutex_lock(&st->lock);
+    st->closing = 1;
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    for(p = 0; p < STREAM_PIPELINES; p++) {
+        pthread_join(st->pipelines[p].thread, NULL);
+        rs_session_destroy(st->pipelines[p].session);
+    }
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->changed);
+    free(st);
+}